@@ -1,46 +1,334 @@
 #include "stdafx.h"
 
-import std.core;
+import std;
 import vm;
 
 using namespace std;
 
-optional<shared_ptr<BaseMemory>> BaseMemory::NetworkVM(TNetworkIndex network_index, TIndexInNetwork index_in_network) const
+void MemoryChanges::AddMemoryRange(size_t begin, size_t end)
 {
-	auto it = network_vms.find(network_index);
-	if (it == network_vms.end())
-		return nullopt;
-	auto it2 = it->second.find(index_in_network);
-	if (it2 == it->second.end())
-		return nullopt;
-	return it2->second;
+	if (begin >= end)
+		return;
+
+	// merge with every range it overlaps or touches
+	auto it = ranges::lower_bound(memory_ranges, begin, {}, &pair<size_t, size_t>::second);
+	if (it != memory_ranges.end() && it->first <= end)
+	{
+		it->first = min(it->first, begin);
+		it->second = max(it->second, end);
+		auto last = next(it);
+		while (last != memory_ranges.end() && last->first <= it->second)
+			it->second = max(it->second, (last++)->second);
+		memory_ranges.erase(next(it), last);
+	}
+	else
+		memory_ranges.insert(it, { begin, end });
+
+	// too many ranges, close the smallest gap
+	if (memory_ranges.size() > MaxMemoryRanges)
+	{
+		size_t smallest = 0;
+		for (size_t i = 1; i + 1 < memory_ranges.size(); ++i)
+			if (memory_ranges[i + 1].first - memory_ranges[i].second < memory_ranges[smallest + 1].first - memory_ranges[smallest].second)
+				smallest = i;
+		memory_ranges[smallest].second = memory_ranges[smallest + 1].second;
+		memory_ranges.erase(memory_ranges.begin() + smallest + 1);
+	}
+}
+
+void MemoryChanges::Merge(const MemoryChanges& other)
+{
+	for (auto&& [begin, end] : other.memory_ranges)
+		AddMemoryRange(begin, end);
+	registers |= other.registers;
+	ip |= other.ip;
+	flags |= other.flags;
+	properties |= other.properties;
+}
+
+bool BaseMemory::PublishChanges()
+{
+	if (pending_changes.Empty())
+		return false;
+
+	{
+		lock_guard lock(changes_mutex);
+		published_changes.push_back(move(pending_changes));
+		if (published_changes.size() > MaxPublishedChanges)
+			published_changes.pop_front();
+		++change_generation;
+	}
+	pending_changes.Clear();
+	return true;
+}
+
+MemoryChanges BaseMemory::ChangesSince(uint64_t& generation) const
+{
+	lock_guard lock(changes_mutex);
+
+	MemoryChanges changes;
+	if (generation + published_changes.size() < change_generation)
+		changes = MemoryChanges::All(memory.Size());
+	else
+		for (auto i = published_changes.size() - (change_generation - generation); i < published_changes.size(); ++i)
+			changes.Merge(published_changes[i]);
+
+	generation = change_generation;
+	return changes;
 }
 
-optional<tuple<TMemory, optional<TRegister>>> BaseMemory::IncomingData(TIndexInNetwork index_in_network) const
+vector<TMemory>& PagedMemory::UnsharePage(size_t page)
+{
+	// the last page only covers the rest of the memory
+	auto& data = pages[page];
+	if (!data)
+		data = make_shared<vector<TMemory>>(min(PageSize, size - page * PageSize));
+	else if (data.use_count() > 1)
+		data = make_shared<vector<TMemory>>(*data);
+	return *data;
+}
+
+void PagedMemory::Write(size_t index, span<const TMemory> values)
+{
+	assert(index <= size && values.size() <= size - index);
+	while (!values.empty())
+	{
+		const auto offset = index & (PageSize - 1);
+		const auto count = min(values.size(), PageSize - offset);
+		auto& page = pages[index >> PageBits];
+		ranges::copy(values.first(count), (page && page.use_count() == 1 ? *page : UnsharePage(index >> PageBits)).begin() + offset);
+		index += count;
+		values = values.subspan(count);
+	}
+}
+
+span<const TMemory> PagedMemory::Read(size_t index, span<TMemory> buffer) const
+{
+	if (index >= size)
+		return {};
+	const auto length = min(buffer.size(), size - index);
+
+	const auto offset = index & (PageSize - 1);
+	if (const auto& page = pages[index >> PageBits]; page && offset + length <= page->size())
+		return span{ *page }.subspan(offset, length);
+
+	for (size_t i = 0; i < length; ++i)
+		buffer[i] = Read(index + i);
+	return buffer.first(length);
+}
+
+void NetworkTopology::Add(BaseMemory& device)
+{
+	if (device.NetworkIndex() >= networks.size())
+		networks.resize(device.NetworkIndex() + 1);
+	auto& network = networks[device.NetworkIndex()];
+	if (device.IndexInNetwork() >= network.size())
+		network.resize(device.IndexInNetwork() + 1);
+	network[device.IndexInNetwork()] = &device;
+}
+
+optional<TNetworkData> BaseMemory::IncomingData(TIndexInNetwork index_in_network) const
 {
 	auto it = incoming_data.find(index_in_network);
-	if (it == incoming_data.end())
+	if (it == incoming_data.end() || it->second.Empty())
 		return nullopt;
-	return it->second;
+	return it->second.Front();
 }
 
-optional<string> BaseMemory::DecodeInstruction(size_t memory_index) const
+size_t BaseMemory::IncomingDataCount(TIndexInNetwork index_in_network) const
 {
-	if (memory_index >= memory.size())
-		return nullopt;
-	auto it = instructions.find((size_t)Memory(memory_index));
-	if (it == instructions.end())
-		return nullopt;
-	return it->second.Decode(this, memory_index);
+	auto it = incoming_data.find(index_in_network);
+	return it == incoming_data.end() ? 0 : it->second.Size();
 }
 
-size_t BaseMemory::IndexFromOpcode(const vector<uint8_t>& opcode) const
+bool BaseMemory::CanSendData(TIndexInNetwork index_in_network) const
 {
-	switch (opcode.size())
+	// only we push into our queue in the destination's inbox, so checking its frozen state is race free and deterministic
+	auto destination = NetworkVM(index_in_network);
+	if (!destination)
+		return false;
+	const auto sent_this_step = ranges::count(outgoing_data | views::keys, destination);
+	return destination->IncomingDataCount(IndexInNetwork()) + sent_this_step < destination->NetworkQueueDepth();
+}
+
+bool BaseMemory::SendData(TIndexInNetwork index_in_network, const TNetworkData& data)
+{
+	if (!CanSendData(index_in_network))
 	{
-	case 1: return (size_t)opcode[0];
-	case 2: return *reinterpret_cast<const uint16_t*>(opcode.data());
-	case 3: case 4: return *reinterpret_cast<const uint32_t*>(opcode.data());
-	default: assert(false); return 0;
+		++network_traffic.failed_sends;
+		return false;
 	}
+	outgoing_data.emplace_back(NetworkVM(index_in_network), data);
+	++network_traffic.messages_sent;
+	++activity;
+	return true;
 }
+
+bool BaseMemory::CopyToMemory(size_t index, span<const TMemory> values)
+{
+	if (index > memory.Size() || values.size() > memory.Size() - index)
+		return false;
+	if (values.empty())
+		return true;
+
+	// the undo log and the watches still go byte by byte, the copy itself goes page by page
+	if (undo_recording || !watched_memory.empty())
+		for (size_t i = 0; i < values.size(); ++i)
+		{
+			const auto old_value = memory.Read(index + i);
+			if (undo_recording)
+				undo_memory_writes.emplace_back(index + i, old_value);
+			if (!watched_memory.empty() && watched_memory[index + i] && old_value != values[i])
+				watched_memory_changed = true;
+		}
+	memory.Write(index, values);
+	OnMemoryWritten(index, index + values.size());
+	pending_changes.AddMemoryRange(index, index + values.size());
+	++activity;
+	return true;
+}
+
+void BaseMemory::CommitConsumedData()
+{
+	for (auto index : consumed_data)
+	{
+		auto& queue = incoming_data.at(index);
+		if (undo_recording)
+			undo_inbox_changes.emplace_back(index, queue.Front());
+		queue.Pop();
+		--incoming_message_count;
+		// the sender's queue to us has room again
+		if (auto sender = NetworkVM(index))
+			++sender->activity;
+	}
+	consumed_data.clear();
+}
+
+void BaseMemory::CommitOutgoingData()
+{
+	for (auto& [destination, data] : outgoing_data)
+	{
+		auto& queue = destination->incoming_data.try_emplace(IndexInNetwork(), destination->NetworkQueueDepth()).first->second;
+		queue.Push(data);
+		++destination->incoming_message_count;
+		++destination->activity;
+		destination->network_traffic.peak_queue_occupancy = max(destination->network_traffic.peak_queue_occupancy, queue.Size());
+		if (destination->undo_recording)
+			destination->undo_inbox_changes.emplace_back(IndexInNetwork(), nullopt);
+	}
+	outgoing_data.clear();
+}
+
+void BaseMemory::SaveRunState(DeviceRunState& state) const
+{
+	state.registers = registers;
+	state.error_message = error_message;
+}
+
+void BaseMemory::LoadRunState(const DeviceRunState& state)
+{
+	registers = state.registers;
+	error_message = state.error_message;
+	pending_changes.registers = ~0u;
+}
+
+DeviceCheckpoint BaseMemory::Checkpoint() const
+{
+	DeviceCheckpoint checkpoint{ memory };
+	SaveRunState(checkpoint.run_state);
+	checkpoint.incoming_data = incoming_data;
+	checkpoint.network_traffic = network_traffic;
+	return checkpoint;
+}
+
+void BaseMemory::Restore(const DeviceCheckpoint& checkpoint)
+{
+	memory = checkpoint.memory;
+	pending_changes.AddMemoryRange(0, memory.Size());
+	OnMemoryRestored();
+
+	LoadRunState(checkpoint.run_state);
+	incoming_data = checkpoint.incoming_data;
+	incoming_message_count = 0;
+	for (auto& queue : incoming_data | views::values)
+		incoming_message_count += queue.Size();
+	++activity;
+	outgoing_data.clear();
+	consumed_data.clear();
+	network_traffic = checkpoint.network_traffic;
+	ClearUndo();
+}
+
+void BaseMemory::BeginUndoTick()
+{
+	if (undo_run_states.size() == undo_ticks.size())
+		undo_run_states.emplace_back();
+	SaveRunState(undo_run_states[undo_ticks.size()]);
+	undo_ticks.push_back({ undo_memory_writes.size(), undo_inbox_changes.size(), network_traffic });
+	undo_recording = true;
+}
+
+bool BaseMemory::UndoTick()
+{
+	if (undo_ticks.empty())
+		return false;
+
+	// both logs in reverse order; memory writes never depend on the inbox changes of the same tick
+	const auto marks = undo_ticks.back();
+	for (auto i = undo_inbox_changes.size(); i-- > marks.inbox_changes; )
+		if (auto& [index, consumed] = undo_inbox_changes[i]; consumed)
+		{
+			incoming_data.at(index).PushFront(*consumed);
+			++incoming_message_count;
+		}
+		else
+		{
+			incoming_data.at(index).PopBack();
+			--incoming_message_count;
+		}
+	for (auto i = undo_memory_writes.size(); i-- > marks.memory_writes; )
+		Memory(undo_memory_writes[i].first, undo_memory_writes[i].second);
+
+	undo_inbox_changes.resize(marks.inbox_changes);
+	undo_memory_writes.resize(marks.memory_writes);
+	network_traffic = marks.network_traffic;
+	undo_ticks.pop_back();
+	LoadRunState(undo_run_states[undo_ticks.size()]);
+	++activity;
+	return true;
+}
+
+void BaseMemory::ClearUndo()
+{
+	undo_recording = false;
+	undo_ticks.clear();
+	undo_memory_writes.clear();
+	undo_inbox_changes.clear();
+}
+
+void BaseMemory::SetupForRun()
+{
+	saved_memory = memory;
+	incoming_data.clear();
+	incoming_message_count = 0;
+	outgoing_data.clear();
+	consumed_data.clear();
+	network_traffic = {};
+	ClearUndo();
+}
+
+const VMInstruction* BaseMemory::FindInstruction(size_t memory_index) const
+{
+	if (!instructions || memory_index >= memory.Size())
+		return nullptr;
+	array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+	return instructions->Find(memory.Read(memory_index, buffer));
+}
+
+optional<string> BaseMemory::DecodeInstruction(size_t memory_index) const
+{
+	auto instruction = FindInstruction(memory_index);
+	if (!instruction)
+		return nullopt;
+	return instruction->Decode(this, memory_index);
+}
\ No newline at end of file
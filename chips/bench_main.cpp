@@ -0,0 +1,480 @@
+#include "stdafx.h"
+
+import std;
+import vm;
+import vm_machines;
+import puzzle;
+import puzzles;
+
+using namespace std;
+
+// every benchmark folds what it computes in here, so none of it can be optimized away
+static volatile uint64_t benchmark_sink;
+
+static constexpr array ExecutionTiers{
+	pair{ "interpreted", VMExecutionTier::Interpreted },
+	pair{ "compiled", VMExecutionTier::Compiled },
+	pair{ "translated", VMExecutionTier::Translated },
+	pair{ "native", VMExecutionTier::Native },
+};
+
+struct BenchmarkResult
+{
+	string group, name, tier, unit;
+	uint64_t operations{};
+	chrono::nanoseconds time{};
+	// for operations spanning several ticks, how many
+	optional<double> ticks_per_operation;
+
+	string FullName() const { return tier.empty() ? format("{}/{}", group, name) : format("{}/{}/{}", group, name, tier); }
+};
+
+static string JsonString(string_view value)
+{
+	string result = "\"";
+	for (auto c : value)
+		if (c == '"' || c == '\\')
+			result += { '\\', c };
+		else if (static_cast<unsigned char>(c) < 0x20)
+			result += format("\\u{:04x}", c);
+		else
+			result += c;
+	return result + '"';
+}
+
+class BenchmarkRunner
+{
+	string filter;
+	chrono::nanoseconds min_time;
+	vector<BenchmarkResult> results;
+
+public:
+	BenchmarkRunner(string filter, chrono::nanoseconds min_time) : filter(move(filter)), min_time(min_time) {}
+
+	bool Selected(const BenchmarkResult& benchmark) const { return benchmark.FullName().contains(filter); }
+
+	// times run(count), which does count operations, in batches that grow until one lasts at least min_time
+	template<typename TRun>
+	void Run(BenchmarkResult benchmark, TRun&& run)
+	{
+		if (!Selected(benchmark))
+			return;
+
+		for (uint64_t count = 1;;)
+		{
+			const auto start = chrono::steady_clock::now();
+			run(count);
+			const auto time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+			if (time >= min_time)
+			{
+				benchmark.operations = count;
+				benchmark.time = time;
+				break;
+			}
+
+			// aim a little past min_time from the rate so far, growing at most a hundredfold per batch
+			const auto scale = time.count() ? 1.2 * min_time.count() / time.count() : 100.0;
+			count = max(count + 1, static_cast<uint64_t>(count * min(scale, 100.0)));
+		}
+
+		println(stderr, "{:<48} {:>12.2f} ns/{}", benchmark.FullName(), NanosecondsPerOperation(benchmark), benchmark.unit);
+		results.push_back(move(benchmark));
+	}
+
+	static double NanosecondsPerOperation(const BenchmarkResult& benchmark)
+	{
+		return static_cast<double>(benchmark.time.count()) / benchmark.operations;
+	}
+
+	// one object with the settings and a flat list of results, stable across versions so runs can be compared
+	string Json() const
+	{
+		string json = format("{{\n\t\"context\": {{ \"min_time_ms\": {}, \"native_tier\": {} }},\n\t\"benchmarks\": [",
+			chrono::duration_cast<chrono::milliseconds>(min_time).count(), VM::NativeTierAvailable());
+		for (size_t index = 0; index < results.size(); ++index)
+		{
+			auto& result = results[index];
+			const auto ns_per_operation = NanosecondsPerOperation(result);
+			json += format("{}\n\t\t{{ \"name\": {}, \"group\": {}, \"case\": {}, \"tier\": {}, \"unit\": {}, \"operations\": {}, \"seconds\": {:.6f}, "
+				"\"ns_per_operation\": {:.3f}, \"operations_per_second\": {:.1f}",
+				index ? "," : "", JsonString(result.FullName()), JsonString(result.group), JsonString(result.name), JsonString(result.tier),
+				JsonString(result.unit), result.operations, chrono::duration<double>(result.time).count(), ns_per_operation, 1e9 / ns_per_operation);
+			if (result.ticks_per_operation)
+				json += format(", \"ticks_per_operation\": {:.3f}", *result.ticks_per_operation);
+			json += " }";
+		}
+		return json + "\n\t]\n}\n";
+	}
+};
+
+// puts the VM on tier, false if it can't run it and fell back to another one
+static bool UseExecutionTier(VM& vm, VMExecutionTier tier)
+{
+	vm.ExecutionTier(tier);
+	return vm.ExecutionTier() == tier;
+}
+
+static bool UseExecutionTier(PuzzleInstance& instance, VMExecutionTier tier)
+{
+	for (auto& device : instance.VMs())
+		if (auto vm = dynamic_pointer_cast<VM>(device); vm && !UseExecutionTier(*vm, tier))
+			return false;
+	return true;
+}
+
+// the instruction repeated over the code area then jumped back from, on its own without any network; instructions that end
+// a block get the address of the next one as their immediates, so jumps fall through, and address operands point past the code.
+// the network instructions are left out: without a network they would only time their failure path, the cases below time them
+static void InstructionThroughput(BenchmarkRunner& runner)
+{
+	constexpr size_t CodeSize = 0x60, DataAddress = 0x70;
+	constexpr array NetworkInstructionNames{ "OUTI8"sv, "IN"sv, "XFER"sv };
+
+	const auto instructions = MakeTest02Machine()->Instructions();
+	const auto jump = ranges::find_if(instructions, [](auto&& instruction) { return string_view(instruction.name) == "JMPI8"; });
+	assert(jump != instructions.end());
+
+	for (auto& instruction : instructions)
+		for (auto [tier_name, tier] : ExecutionTiers)
+		{
+			BenchmarkResult benchmark{ .group = "instruction", .name = instruction.name, .tier = tier_name, .unit = "instruction" };
+			if (ranges::find(NetworkInstructionNames, benchmark.name) != NetworkInstructionNames.end() || !runner.Selected(benchmark))
+				continue;
+
+			auto vm = MakeTest02Machine();
+			if (!UseExecutionTier(*vm, tier))
+				continue;
+
+			size_t address = 0, repeats = 0;
+			for (; address + instruction.OpcodeLength() + jump->OpcodeLength() <= CodeSize; address += instruction.OpcodeLength(), ++repeats)
+			{
+				auto byte = address;
+				for (auto opcode : instruction.base_opcode)
+					vm->Memory(byte++, opcode);
+				for (auto& operand : instruction.operands)
+					if (holds_alternative<Addr>(operand))
+						vm->Memory(byte++, DataAddress);
+					else if (holds_alternative<Reg>(operand))
+						vm->Memory(byte++, 0);
+					else
+						vm->Memory(byte++, static_cast<TMemory>(instruction.ends_block ? address + instruction.OpcodeLength() : 1));
+			}
+			vm->Memory(address, jump->base_opcode.front());
+			vm->Memory(address + 1, 0);
+
+			vm->SetupForRun();
+			runner.Run(benchmark, [&](uint64_t count)
+				{
+					// the jump back is one more step every repeats instructions
+					for (uint64_t step = 0; step < count + count / repeats; ++step)
+						vm->Step();
+					benchmark_sink = vm->Register(0);
+				});
+		}
+}
+
+// a random stream of valid instructions, looked up and decoded, then disassembled to text
+static void DecodeThroughput(BenchmarkRunner& runner)
+{
+	auto vm = MakeTest16Machine();
+	const auto& instructions = vm->Instructions();
+	const VMInstructionTable table(instructions);
+
+	mt19937_64 random_engine(1);
+	uniform_int_distribution<size_t> instruction_distribution(0, instructions.size() - 1);
+	uniform_int_distribution<uint16_t> byte_distribution(0, 255);
+	vector<TMemory> program;
+	vector<size_t> addresses;
+	while (program.size() < 0x1000)
+	{
+		auto& instruction = instructions[instruction_distribution(random_engine)];
+		addresses.push_back(program.size());
+		program.insert(program.end(), instruction.base_opcode.begin(), instruction.base_opcode.end());
+		while (program.size() < addresses.back() + instruction.OpcodeLength())
+			program.push_back(static_cast<TMemory>(byte_distribution(random_engine)));
+	}
+	vm->CopyToMemory(0, program);
+
+	runner.Run({ .group = "decode", .name = "find_and_decode_operands", .unit = "instruction" }, [&](uint64_t count)
+		{
+			vector<size_t> operand_values;
+			uint64_t sum = 0;
+			for (uint64_t index = 0; index < count; ++index)
+			{
+				const auto address = addresses[index % addresses.size()];
+				auto instruction = table.Find(span{ program }.subspan(address));
+				if (instruction && instruction->DecodeOperands(program, address, operand_values))
+					sum += operand_values.size();
+			}
+			benchmark_sink = sum;
+		});
+
+	runner.Run({ .group = "decode", .name = "disassemble", .unit = "instruction" }, [&](uint64_t count)
+		{
+			uint64_t sum = 0;
+			for (uint64_t index = 0; index < count; ++index)
+				sum += vm->DecodeInstruction(addresses[index % addresses.size()]).value_or("").size();
+			benchmark_sink = sum;
+		});
+}
+
+// ticks between two executions of marker in the first device's program, from a profiled run
+static double TicksPerExecution(Puzzle& puzzle, size_t marker)
+{
+	constexpr size_t Ticks = 10'000;
+
+	auto instance = puzzle.make();
+	auto vm = static_pointer_cast<VM>(instance->VM(0));
+	vm->Profiling(true);
+	instance->SetupForRun();
+	for (size_t tick = 0; tick < Ticks; ++tick)
+		instance->Tick();
+	const auto executions = vm->Profile()->executions[marker];
+	return executions ? static_cast<double>(Ticks) / executions : 0;
+}
+
+// a CPU program looping through marker once per operation, ticked as a whole puzzle with its devices
+static void ProgramThroughput(BenchmarkRunner& runner, BenchmarkResult benchmark, Puzzle& puzzle, size_t marker)
+{
+	// the same on every tier
+	benchmark.ticks_per_operation = TicksPerExecution(puzzle, marker);
+
+	for (auto [tier_name, tier] : ExecutionTiers)
+	{
+		benchmark.tier = tier_name;
+		if (!runner.Selected(benchmark))
+			continue;
+
+		auto instance = puzzle.make();
+		if (!UseExecutionTier(*instance, tier))
+			continue;
+
+		instance->SetupForRun();
+		runner.Run(benchmark, [&](uint64_t count)
+			{
+				for (auto tick = llround(count * *benchmark.ticks_per_operation); tick > 0; --tick)
+					instance->Tick();
+				benchmark_sink = instance->Steps();
+			});
+	}
+}
+
+// OUT to a RAM followed by an IN of the same byte, waited for in a loop
+static void NetworkRoundTrip(BenchmarkRunner& runner)
+{
+	static Puzzle puzzle{
+		{ { { "CPU", MakeTest02Machine, false, {
+			0x03, 0x10,		// 00 LDR1I8 10
+			0x02, 0x01,		// 02 LDR0I8 01
+			0x0D,			// 04 IN
+			0x0B, 0x09,		// 05 JMPNZI8 09
+			0x0A, 0x02,		// 07 JMPI8 02
+			0x02, 0x01,		// 09 LDR0I8 01
+			0x0C, 0x2A,		// 0B OUTI8 2A
+			0x0A, 0x02,		// 0D JMPI8 02
+		} }, { "RAM", MakeRAM128Machine, false, {} } } },
+		"OUT/IN round trip", "", [](auto&) {}, {} };
+
+	ProgramThroughput(runner, { .group = "network", .name = "ram_round_trip", .unit = "round trip" }, puzzle, 0x0B);
+}
+
+// a 64 byte block copied from the CPU to a RAM through a DMA, requested again as soon as the last one is done
+static void DMABlockCopies(BenchmarkRunner& runner)
+{
+	static Puzzle puzzle{
+		{ { { "CPU", MakeTest02Machine, false, {
+			0x02, 0x01,		// 00 LDR0I8 01
+			0x10, 0x70,		// 02 XFER 70
+			0x0B, 0x08,		// 04 JMPNZI8 08
+			0x0A, 0x02,		// 06 JMPI8 02
+			0x0A, 0x00,		// 08 JMPI8 00
+		} }, { "DMA", MakeDMAMachine, false, {} }, { "RAM", MakeRAM128Machine, false, {} } } },
+		"DMA block copies", "",
+		[](auto& puzzle_instance) {
+			// CPU 0x00-0x3F to RAM 0x00-0x3F
+			puzzle_instance.VM(0)->CopyToMemory(0x70, array<TMemory, DMA::DescriptorSize>{ 0, 0x00, 0x00, 2, 0x00, 0x00, 0x40, 0x00 });
+		}, {} };
+
+	ProgramThroughput(runner, { .group = "network", .name = "dma_block_copy", .unit = "64 byte copy" }, puzzle, 0x08);
+}
+
+// one OUT per pass through a loop bumping the cell address, across the first 256 bytes of a large display
+static void DisplayWrites(BenchmarkRunner& runner)
+{
+	static Puzzle puzzle{
+		{ { { "CPU", MakeTest02Machine, false, {
+			0x02, 0x01,		// 00 LDR0I8 01
+			0x0C, 0x41,		// 02 OUTI8 41
+			0x05, 0x70,		// 04 STR1 70
+			0x00, 0x70,		// 06 LDR0 70
+			0x06, 0x01,		// 08 ADDI8 01
+			0x04, 0x70,		// 0A STR0 70
+			0x01, 0x70,		// 0C LDR1 70
+			0x0A, 0x00,		// 0E JMPI8 00
+		} }, { "Display", MakeDisplay32x16Machine, false, {} } } },
+		"Display writes", "", [](auto&) {}, {} };
+
+	ProgramThroughput(runner, { .group = "display", .name = "write", .unit = "write" }, puzzle, 0x02);
+}
+
+// a whole 80x25 frame copied from a 16-bit CPU's memory to the display through a DMA, over and over
+static void DisplayFrameCopies(BenchmarkRunner& runner)
+{
+	static Puzzle puzzle{
+		{ { { "CPU", MakeTest16Machine, false, {
+			0x02, 0x01,				// 0000 LDR0I8 01
+			0x10, 0x00, 0x01,		// 0002 XFER 0100
+			0x0B, 0x0B, 0x00,		// 0005 JMPNZ 000B
+			0x0A, 0x02, 0x00,		// 0008 JMP 0002
+			0x0A, 0x00, 0x00,		// 000B JMP 0000
+		} }, { "DMA", MakeDMAMachine, false, {} }, { "Display", MakeDisplay80x25Machine, false, {} } } },
+		"Display frame copies", "",
+		[](auto& puzzle_instance) {
+			// a frame of letters in every color at 0x1000, copied to the start of the display
+			constexpr size_t FrameSize = 80 * 25 * 3;
+			vector<TMemory> frame(FrameSize);
+			for (size_t cell = 0; cell < FrameSize / 3; ++cell)
+			{
+				frame[cell * 3] = static_cast<TMemory>('A' + cell % 26);
+				frame[cell * 3 + 1] = static_cast<TMemory>(cell % 16);
+				frame[cell * 3 + 2] = static_cast<TMemory>(15 - cell % 16);
+			}
+			auto cpu = puzzle_instance.VM(0);
+			cpu->CopyToMemory(0x1000, frame);
+			cpu->CopyToMemory(0x0100, array<TMemory, DMA::DescriptorSize>{ 0, 0x00, 0x10, 2, 0x00, 0x00, FrameSize & 0xFF, FrameSize >> 8 });
+		}, {} };
+
+	ProgramThroughput(runner, { .group = "display", .name = "frame_dma", .unit = "frame" }, puzzle, 0x0B);
+}
+
+// whole runs to completion on fresh instances, the way a validation runs every seed: a 256 by 256 counted loop on its own,
+// then writing the answer its check watches for; and the networked puzzle's built-in program, which keeps polling its ROM
+static void PuzzleRuns(BenchmarkRunner& runner)
+{
+	static Puzzle counted_loops{
+		{ { { "CPU", MakeTest02Machine, false, {
+			0x02, 0x00,		// 00 LDR0I8 00
+			0x08, 0x01,		// 02 SUBI8 01
+			0x0E,			// 04 TESTZ
+			0x0B, 0x02,		// 05 JMPNZI8 02
+			0x00, 0x70,		// 07 LDR0 70
+			0x06, 0x01,		// 09 ADDI8 01
+			0x04, 0x70,		// 0B STR0 70
+			0x0E,			// 0D TESTZ
+			0x0B, 0x00,		// 0E JMPNZI8 00
+			0x02, 0xDE,		// 10 LDR0I8 DE
+			0x04, 0x10,		// 12 STR0 10
+			0x0A, 0x14,		// 14 JMPI8 14
+		} } } },
+		"Counted loops", "", [](auto&) {},
+		{ { [](auto& puzzle_instance) { return puzzle_instance.VM(0)->Memory(0x10) == 0xDE; }, { { 0, 0x10, 0x11 } } } } };
+
+	for (auto [name, puzzle] : { pair{ "counted_loops", &counted_loops }, pair{ "networked_sum", &Puzzles[1] } })
+	{
+		constexpr size_t MaxSteps = 1'000'000;
+		BenchmarkResult benchmark{ .group = "run", .name = name, .unit = "run" };
+		benchmark.ticks_per_operation = static_cast<double>(puzzle->make()->RunToCompletion(MaxSteps).steps);
+
+		for (auto [tier_name, tier] : ExecutionTiers)
+		{
+			benchmark.tier = tier_name;
+			if (!runner.Selected(benchmark) || !UseExecutionTier(*puzzle->make(), tier))
+				continue;
+
+			uint64_t seed = 0;
+			runner.Run(benchmark, [&](uint64_t count)
+				{
+					uint64_t steps = 0;
+					for (uint64_t run = 0; run < count; ++run)
+					{
+						auto instance = puzzle->make();
+						UseExecutionTier(*instance, tier);
+						instance->Seed(seed++);
+						steps += instance->RunToCompletion(MaxSteps).steps;
+					}
+					benchmark_sink = steps;
+				});
+		}
+	}
+}
+
+// every puzzle with its built-in program, run again whenever its checks pass like a validation over many seeds
+static void PuzzleSteps(BenchmarkRunner& runner)
+{
+	for (auto& puzzle : Puzzles)
+		for (auto [tier_name, tier] : ExecutionTiers)
+		{
+			BenchmarkResult benchmark{ .group = "puzzle", .name = puzzle.name, .tier = tier_name, .unit = "step" };
+			if (!runner.Selected(benchmark))
+				continue;
+
+			// a run that passed leaves its results in memory, so setting it up again would pass on the next tick;
+			// the next run gets a fresh instance with the next seed instead
+			uint64_t seed = 0;
+			const auto make_instance = [&]
+				{
+					auto instance = puzzle.make();
+					UseExecutionTier(*instance, tier);
+					instance->Seed(seed++);
+					instance->SetupForRun();
+					return instance;
+				};
+			auto instance = make_instance();
+			if (!UseExecutionTier(*instance, tier))
+				continue;
+
+			runner.Run(benchmark, [&](uint64_t count)
+				{
+					for (uint64_t step = 0; step < count; ++step)
+						if (instance->Tick())
+							instance = make_instance();
+					benchmark_sink = instance->Steps();
+				});
+		}
+}
+
+static void PrintUsage()
+{
+	println(stderr, "usage: chips-bench [--filter TEXT] [--min-time MS] [--output FILE]");
+	println(stderr, "       runs the benchmarks whose group/case/tier name contains TEXT, each for at least MS milliseconds,");
+	println(stderr, "       and writes the results as JSON to FILE or the standard output");
+}
+
+int main(int argc, char** argv)
+{
+	const vector<string> args(argv + 1, argv + argc);
+
+	string filter, output_path;
+	chrono::milliseconds min_time{ 200 };
+	for (size_t i = 0; i < args.size(); ++i)
+		if (args[i] == "--filter" && i + 1 < args.size())
+			filter = args[++i];
+		else if (args[i] == "--min-time" && i + 1 < args.size())
+			min_time = chrono::milliseconds(stoull(args[++i]));
+		else if (args[i] == "--output" && i + 1 < args.size())
+			output_path = args[++i];
+		else
+		{
+			PrintUsage();
+			return 2;
+		}
+
+	BenchmarkRunner runner(filter, min_time);
+	InstructionThroughput(runner);
+	DecodeThroughput(runner);
+	NetworkRoundTrip(runner);
+	DMABlockCopies(runner);
+	DisplayWrites(runner);
+	DisplayFrameCopies(runner);
+	PuzzleSteps(runner);
+	PuzzleRuns(runner);
+
+	if (output_path.empty())
+		print("{}", runner.Json());
+	else if (ofstream file(output_path); !(file << runner.Json()))
+	{
+		println(stderr, "Cannot write the results to \"{}\".", output_path);
+		return 1;
+	}
+	return 0;
+}
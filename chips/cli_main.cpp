@@ -0,0 +1,302 @@
+#include "stdafx.h"
+
+import std;
+import vm;
+import puzzle;
+import puzzles;
+import puzzle_validation;
+import thread_pool;
+
+using namespace std;
+
+static void PrintUsage()
+{
+	println(stderr, "usage: chips-cli <puzzle name or index> <program image> [--max-steps N] [--device N]");
+	println(stderr, "                 [--tier interpreted|compiled|translated|native] [--interpreted] [--differential]");
+	println(stderr, "                 [--seed N] [--seeds N] [--threads N] [--device-threads N] [--json FILE]");
+	println(stderr, "       chips-cli --list");
+}
+
+static optional<size_t> FindPuzzle(string_view name_or_index)
+{
+	for (size_t index = 0; index < Puzzles.size(); ++index)
+		if (Puzzles[index].name == name_or_index || to_string(index) == name_or_index)
+			return index;
+	return nullopt;
+}
+
+static optional<VMExecutionTier> ParseExecutionTier(string_view name)
+{
+	if (name == "interpreted")
+		return VMExecutionTier::Interpreted;
+	if (name == "compiled")
+		return VMExecutionTier::Compiled;
+	if (name == "translated")
+		return VMExecutionTier::Translated;
+	if (name == "native")
+		return VMExecutionTier::Native;
+	return nullopt;
+}
+
+// the first device whose state differs between two instances of a puzzle, if any
+static optional<string> FindDifference(PuzzleInstance& expected, PuzzleInstance& actual)
+{
+	for (size_t index = 0; index < expected.VMs().size(); ++index)
+	{
+		auto& expected_device = *expected.VM(index);
+		auto& actual_device = *actual.VM(index);
+		const auto name = format("{}/{} {}", expected_device.NetworkIndex(), expected_device.IndexInNetwork(), expected_device.Name());
+
+		if (expected_device.ErrorMessage() != actual_device.ErrorMessage())
+			return format("{}: error \"{}\" instead of \"{}\"", name, actual_device.ErrorMessage(), expected_device.ErrorMessage());
+
+		if (auto expected_vm = dynamic_cast<VM*>(&expected_device))
+		{
+			auto actual_vm = static_cast<VM*>(&actual_device);
+			if (expected_vm->IP() != actual_vm->IP())
+				return format("{}: IP {:#x} instead of {:#x}", name, actual_vm->IP(), expected_vm->IP());
+			if (expected_vm->FlagZero() != actual_vm->FlagZero())
+				return format("{}: zero flag {} instead of {}", name, actual_vm->FlagZero(), expected_vm->FlagZero());
+			for (int register_index = 0; register_index < static_cast<int>(expected_vm->RegisterCount()); ++register_index)
+				if (expected_vm->Register(register_index) != actual_vm->Register(register_index))
+					return format("{}: {} {:#04x} instead of {:#04x}", name, expected_vm->RegisterName(register_index),
+						actual_vm->Register(register_index), expected_vm->Register(register_index));
+		}
+
+		array<TMemory, 256> expected_buffer, actual_buffer;
+		for (size_t address = 0; address < expected_device.MemorySize(); address += expected_buffer.size())
+		{
+			const auto expected_bytes = expected_device.Memory(address, expected_buffer);
+			const auto actual_bytes = actual_device.Memory(address, actual_buffer);
+			if (const auto [expected_it, actual_it] = ranges::mismatch(expected_bytes, actual_bytes); expected_it != expected_bytes.end())
+				return format("{}: memory at {:#x} is {:#04x} instead of {:#04x}", name,
+					address + distance(expected_bytes.begin(), expected_it), *actual_it, *expected_it);
+		}
+	}
+	return nullopt;
+}
+
+static optional<vector<TMemory>> ReadProgramImage(const string& path)
+{
+	ifstream file(path, ios::binary);
+	if (!file)
+		return nullopt;
+	return vector<TMemory>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+int main(int argc, char** argv)
+{
+	const vector<string> args(argv + 1, argv + argc);
+
+	if (args.size() == 1 && args[0] == "--list")
+	{
+		for (size_t index = 0; index < Puzzles.size(); ++index)
+			println("{}: {}", index, Puzzles[index].name);
+		return 0;
+	}
+
+	vector<string> positional;
+	size_t max_steps = 1'000'000;
+	optional<size_t> device_index;
+	optional<VMExecutionTier> execution_tier = VMExecutionTier::Compiled;
+	uint64_t first_seed = 0;
+	size_t seed_count = 1;
+	size_t thread_count = max(thread::hardware_concurrency(), 1u);
+	size_t device_thread_count = 1;
+	bool differential = false;
+	string json_path;
+	for (size_t i = 0; i < args.size(); ++i)
+		if (args[i] == "--max-steps" && i + 1 < args.size())
+			max_steps = stoull(args[++i]);
+		else if (args[i] == "--device" && i + 1 < args.size())
+			device_index = stoull(args[++i]);
+		else if (args[i] == "--seed" && i + 1 < args.size())
+			first_seed = stoull(args[++i]);
+		else if (args[i] == "--seeds" && i + 1 < args.size())
+			seed_count = stoull(args[++i]);
+		else if (args[i] == "--threads" && i + 1 < args.size())
+			thread_count = stoull(args[++i]);
+		else if (args[i] == "--device-threads" && i + 1 < args.size())
+			device_thread_count = stoull(args[++i]);
+		else if (args[i] == "--tier" && i + 1 < args.size())
+			execution_tier = ParseExecutionTier(args[++i]);
+		else if (args[i] == "--interpreted")
+			execution_tier = VMExecutionTier::Interpreted;
+		else if (args[i] == "--differential")
+			differential = true;
+		else if (args[i] == "--json" && i + 1 < args.size())
+			json_path = args[++i];
+		else if (args[i].starts_with("--"))
+		{
+			PrintUsage();
+			return 2;
+		}
+		else
+			positional.push_back(args[i]);
+
+	// the devices of a single run can share a pool, concurrent seeds cannot
+	if (positional.size() != 2 || !seed_count || (seed_count > 1 && device_thread_count > 1) || !execution_tier)
+	{
+		PrintUsage();
+		return 2;
+	}
+
+	const auto puzzle_index = FindPuzzle(positional[0]);
+	if (!puzzle_index)
+	{
+		println(stderr, "Unknown puzzle \"{}\", use --list to see the available puzzles.", positional[0]);
+		return 2;
+	}
+
+	const auto image = ReadProgramImage(positional[1]);
+	if (!image)
+	{
+		println(stderr, "Cannot read the program image \"{}\".", positional[1]);
+		return 2;
+	}
+
+	auto& puzzle = Puzzles[*puzzle_index];
+
+	// every seed runs on its own instance, this one only resolves and checks the target device
+	auto puzzle_instance = puzzle.make();
+
+	// the image goes into the requested device, or the first one the player can edit
+	if (!device_index)
+		if (auto it = ranges::find_if(puzzle_instance->VMs(), [](auto&& vm) { return vm->Editable(); }); it != puzzle_instance->VMs().end())
+			device_index = distance(puzzle_instance->VMs().begin(), it);
+	if (!device_index || *device_index >= puzzle_instance->VMs().size())
+	{
+		println(stderr, "No device to load the program image into.");
+		return 2;
+	}
+
+	auto device = puzzle_instance->VM(*device_index);
+	if (image->size() > device->MemorySize())
+	{
+		println(stderr, "The program image ({} bytes) does not fit in {} ({} bytes).", image->size(), device->Name(), device->MemorySize());
+		return 2;
+	}
+
+	unique_ptr<ThreadPool> device_thread_pool;
+	if (device_thread_count > 1)
+		device_thread_pool = make_unique<ThreadPool>(device_thread_count);
+
+	const auto prepare_tier = [&](PuzzleInstance& instance, VMExecutionTier tier)
+		{
+			instance.DeviceThreadPool(device_thread_pool.get());
+
+			auto device = instance.VM(*device_index);
+			for (size_t i = 0; i < image->size(); ++i)
+				device->Memory(i, (*image)[i]);
+
+			for (auto& base_memory : instance.VMs())
+				if (auto vm = dynamic_pointer_cast<VM>(base_memory))
+					vm->ExecutionTier(tier);
+		};
+	const auto prepare = [&](PuzzleInstance& instance) { prepare_tier(instance, *execution_tier); };
+
+	// ticks every seed on the requested tier and on the interpreter side by side, then runs both to completion the way a
+	// validation does, where a device stepping alone goes through several ticks at once; stops at the first difference
+	if (differential)
+	{
+		for (auto seed = first_seed; seed < first_seed + seed_count; ++seed)
+		{
+			auto expected = puzzle.make(), actual = puzzle.make();
+			prepare_tier(*expected, VMExecutionTier::Interpreted);
+			prepare_tier(*actual, *execution_tier);
+			// compared tick by tick, so every device has to step every tick
+			expected->DetectLoops(false);
+			actual->DetectLoops(false);
+			expected->Seed(seed);
+			actual->Seed(seed);
+			expected->SetupForRun();
+			actual->SetupForRun();
+
+			for (size_t step = 0; step < max_steps; ++step)
+			{
+				const auto passed = expected->Tick();
+				if (actual->Tick() != passed)
+				{
+					println("DIFFERENT {} seed {} step {}: the checks {} only on the interpreter", puzzle.name, seed, step + 1, passed ? "passed" : "failed");
+					return 1;
+				}
+				if (const auto difference = FindDifference(*expected, *actual))
+				{
+					println("DIFFERENT {} seed {} step {}: {}", puzzle.name, seed, step + 1, *difference);
+					return 1;
+				}
+				if (passed)
+					break;
+			}
+
+			expected->DetectLoops(true);
+			actual->DetectLoops(true);
+			const auto expected_run = expected->RunToCompletion(max_steps);
+			const auto actual_run = actual->RunToCompletion(max_steps);
+			if (actual_run.passed != expected_run.passed || actual_run.steps != expected_run.steps || actual_run.errors != expected_run.errors
+				|| actual_run.stall != expected_run.stall || actual_run.traffic.messages_sent != expected_run.traffic.messages_sent
+				|| actual_run.traffic.failed_sends != expected_run.traffic.failed_sends
+				|| actual_run.traffic.peak_queue_occupancy != expected_run.traffic.peak_queue_occupancy)
+			{
+				println("DIFFERENT {} seed {}: the run to completion {} after {} steps instead of {} after {}", puzzle.name, seed,
+					actual_run.passed ? "passed" : "failed", actual_run.steps, expected_run.passed ? "passed" : "failed", expected_run.steps);
+				return 1;
+			}
+			if (const auto difference = FindDifference(*expected, *actual))
+			{
+				println("DIFFERENT {} seed {} after the run to completion: {}", puzzle.name, seed, *difference);
+				return 1;
+			}
+		}
+
+		println("SAME {}", puzzle.name);
+		println("seeds: {}..{} ticked and ran to completion identically to the interpreter", first_seed, first_seed + seed_count - 1);
+		return 0;
+	}
+
+	const auto validation = ValidatePuzzle(puzzle, prepare, first_seed, seed_count, max_steps, thread_count);
+
+	// the score with every seed's numbers, for ranking solutions outside of the game
+	if (!json_path.empty())
+		if (ofstream file(json_path); !(file << ValidationJson(puzzle, validation)))
+		{
+			println(stderr, "Cannot write the score to \"{}\".", json_path);
+			return 2;
+		}
+
+	if (seed_count == 1)
+	{
+		const auto& result = validation.seed_results.front().run;
+		const auto seconds = chrono::duration<double>(result.wall_time).count();
+		println("{} {}", result.passed ? "PASS" : "FAIL", puzzle.name);
+		println("steps: {}", result.steps);
+		println("program size: {} bytes", validation.score.program_size);
+		println("messages: {} sent, {} failed sends, peak queue {}", result.traffic.messages_sent, result.traffic.failed_sends, result.traffic.peak_queue_occupancy);
+		println("wall time: {:.3f} ms ({:.0f} steps/s)", seconds * 1000, seconds > 0 ? result.steps / seconds : 0.0);
+		for (auto& error : result.errors)
+			println("error: {}", error);
+		if (!result.stall.empty())
+			println("{}", result.stall);
+		return result.passed ? 0 : 1;
+	}
+
+	println("{} {}", validation.Passed() ? "PASS" : "FAIL", puzzle.name);
+	println("seeds: {}..{} ({} passed, {:.1f}%)", first_seed, first_seed + seed_count - 1,
+		seed_count - validation.failing_seeds.size(), validation.pass_rate * 100);
+	println("steps: min {} / avg {:.1f} / max {}", validation.min_steps, validation.average_steps, validation.max_steps);
+	println("program size: {} bytes", validation.score.program_size);
+	println("messages: avg {:.1f} sent / avg {:.1f} failed sends / peak queue {}", validation.score.messages_sent.average,
+		validation.score.failed_sends.average, validation.score.peak_queue_occupancy.max);
+	println("wall time: {:.3f} ms", chrono::duration<double, milli>(validation.wall_time).count());
+	for (auto& seed_result : validation.seed_results)
+		if (!seed_result.run.passed)
+		{
+			println("failing seed: {} ({} steps)", seed_result.seed, seed_result.run.steps);
+			for (auto& error : seed_result.run.errors)
+				println("  error: {}", error);
+			if (!seed_result.run.stall.empty())
+				println("  {}", seed_result.run.stall);
+		}
+
+	return validation.Passed() ? 0 : 1;
+}
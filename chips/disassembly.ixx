@@ -0,0 +1,138 @@
+module;
+
+#include "stdafx.h"
+
+export module disassembly;
+
+import std;
+import vm;
+import vm_instruction_set;
+
+using namespace std;
+
+// one line of a listing: an instruction, or a single byte no instruction decodes from
+export struct DisassemblyLine
+{
+	size_t address{}, length{};
+	// null for a byte that doesn't decode
+	const VMInstruction* instruction{};
+	string text;
+	// where a jump goes, when that is inside the memory
+	optional<size_t> jump_target;
+};
+
+// a device's whole memory disassembled front to back, the way the IP walks it from 0; an update decodes again only the lines
+// the published writes touched, up to where the decoding falls back in step with the old lines
+export class Disassembly
+{
+	shared_ptr<const BaseMemory> memory;
+	vector<DisassemblyLine> lines;
+	// how many lines jump to each address
+	vector<uint32_t> jump_sources;
+	uint64_t change_generation{};
+	size_t decoded_line_count{};
+
+	static bool IsJump(const VMInstruction& instruction)
+	{
+		return instruction.semantics == &JmpImm8::Execute || instruction.semantics == &JmpNotZeroImm8::Execute
+			|| instruction.semantics == &JmpAddress::Execute || instruction.semantics == &JmpNotZeroAddress::Execute;
+	}
+
+	DisassemblyLine DecodeLine(size_t address) const
+	{
+		if (auto instruction = memory->FindInstruction(address))
+			if (auto text = instruction->Decode(memory.get(), address))
+			{
+				DisassemblyLine line{ address, instruction->OpcodeLength(), instruction, move(*text) };
+				if (IsJump(*instruction))
+				{
+					array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+					vector<size_t> operand_values;
+					if (instruction->DecodeOperands(memory->Memory(address, span{ buffer }.first(line.length)), 0, operand_values)
+						&& operand_values[0] < memory->MemorySize())
+						line.jump_target = operand_values[0];
+				}
+				return line;
+			}
+		return { address, 1, nullptr, format("??? {:#04x}", memory->Memory(address)) };
+	}
+
+	void CountJump(const DisassemblyLine& line, int sources)
+	{
+		if (line.jump_target)
+			jump_sources[*line.jump_target] += sources;
+	}
+
+	// decodes again from the line holding begin, or one whose decoding looked that far, until past end an old line starts
+	// where the next new one does
+	void Redecode(size_t begin, size_t end)
+	{
+		const auto first = LineIndex(begin - min(begin, memory->MaxInstructionLength() - 1));
+		auto last = first;
+		auto address = first < lines.size() ? lines[first].address : 0;
+
+		vector<DisassemblyLine> decoded;
+		for (;;)
+		{
+			while (last < lines.size() && lines[last].address < address)
+				++last;
+			if (address >= memory->MemorySize() || address >= end && last < lines.size() && lines[last].address == address)
+				break;
+			decoded.push_back(DecodeLine(address));
+			address += decoded.back().length;
+		}
+
+		for (auto index = first; index < last; ++index)
+			CountJump(lines[index], -1);
+		for (auto& line : decoded)
+			CountJump(line, 1);
+		decoded_line_count += decoded.size();
+
+		// most writes keep the lengths, leaving the lines after them where they are
+		const auto kept = min(last - first, decoded.size());
+		ranges::move(decoded.begin(), decoded.begin() + kept, lines.begin() + first);
+		if (decoded.size() > kept)
+			lines.insert(lines.begin() + last, make_move_iterator(decoded.begin() + kept), make_move_iterator(decoded.end()));
+		else
+			lines.erase(lines.begin() + first + kept, lines.begin() + last);
+	}
+
+public:
+	explicit Disassembly(shared_ptr<const BaseMemory> memory)
+		: memory(move(memory)), jump_sources(this->memory->MemorySize())
+	{
+	}
+
+	// decodes what changed since the last update, the whole memory the first time; returns whether any line was decoded
+	bool Update()
+	{
+		const auto changes = memory->ChangesSince(change_generation);
+		decoded_line_count = 0;
+		if (lines.empty())
+			Redecode(0, memory->MemorySize());
+		else
+			for (auto&& [begin, end] : changes.memory_ranges)
+				Redecode(begin, min(end, memory->MemorySize()));
+		return decoded_line_count > 0;
+	}
+
+	const auto& Lines() const { return lines; }
+	// the index of the line holding address
+	size_t LineIndex(size_t address) const
+	{
+		const auto it = ranges::upper_bound(lines, address, {}, &DisassemblyLine::address);
+		return it == lines.begin() ? 0 : static_cast<size_t>(it - lines.begin() - 1);
+	}
+	// whether any line jumps to address
+	bool JumpTarget(size_t address) const { return address < jump_sources.size() && jump_sources[address]; }
+	// how many lines the last update decoded
+	auto DecodedLineCount() const { return decoded_line_count; }
+
+	// the instruction at address as text, from the listing when a line starts there
+	optional<string> InstructionText(size_t address) const
+	{
+		if (const auto index = LineIndex(address); index < lines.size() && lines[index].address == address)
+			return lines[index].instruction ? make_optional(lines[index].text) : nullopt;
+		return memory->DecodeInstruction(address);
+	}
+};
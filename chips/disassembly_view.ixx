@@ -0,0 +1,141 @@
+module;
+
+#include "stdafx.h"
+
+export module disassembly_view;
+
+import std.core;
+import disassembly;
+import hex_editor;
+
+using namespace std;
+using namespace ftxui;
+
+export struct DisassemblyViewOption
+{
+	static DisassemblyViewOption Default();
+
+	shared_ptr<Disassembly> disassembly;
+	// whose cursor and IP the listing follows, and whose cursor a click moves
+	shared_ptr<HexEditorBase> hex_editor;
+};
+
+export class DisassemblyViewBase : public ComponentBase, public DisassemblyViewOption
+{
+public:
+	DisassemblyViewBase(DisassemblyViewOption option)
+		: DisassemblyViewOption(move(option))
+	{
+	}
+
+	Element Render() override final
+	{
+		disassembly->Update();
+		const auto& lines = disassembly->Lines();
+
+		const auto cursor_address = (size_t)*hex_editor->cursor_half_byte_position / 2;
+		const auto cursor_line = disassembly->LineIndex(cursor_address);
+		const auto ip_address = *hex_editor->ip ? (*hex_editor->ip)() : nullopt;
+		const auto ip_line = ip_address ? disassembly->LineIndex(*ip_address) : numeric_limits<size_t>::max();
+
+		// only the lines that fit in the space we got last frame are built, following the cursor or the IP when either moved
+		if (view_box_.y_max > view_box_.y_min)
+			visible_lines = max(view_box_.y_max - view_box_.y_min + 1 - 2, 1);
+		if (cursor_address != followed_cursor_address)
+		{
+			followed_cursor_address = cursor_address;
+			ScrollTo(cursor_line);
+		}
+		if (ip_address != followed_ip_address)
+		{
+			followed_ip_address = ip_address;
+			if (ip_address)
+				ScrollTo(ip_line);
+		}
+		first_visible_line = min(first_visible_line, lines.size() - min(lines.size(), (size_t)visible_lines));
+		const auto last_visible_line = min(lines.size(), first_visible_line + visible_lines);
+
+		Elements elements;
+		elements.reserve(last_visible_line - first_visible_line + 2);
+		elements.push_back(text(format("{} lines", lines.size())) | dim);
+		elements.push_back(separator());
+
+		const auto address_digits = max<size_t>(2, (bit_width(max<size_t>(*hex_editor->content_size, 1) - 1) + 3) / 4);
+		for (auto index = first_visible_line; index < last_visible_line; ++index)
+		{
+			const auto& line = lines[index];
+			auto row = hbox({
+				text(format("{:0{}X}", line.address, address_digits)) | dim,
+				// lines something jumps to
+				disassembly->JumpTarget(line.address) ? text(" ► ") | color(Color::Aquamarine1) : text("   "),
+				line.instruction ? text(line.text) : text(line.text) | dim,
+				});
+			if (index == ip_line)
+				row |= inverted;
+			if (index == cursor_line)
+				row |= bold;
+			elements.push_back(move(row));
+		}
+
+		return vbox(move(elements)) | reflect(box_) | yframe | yflex | reflect(view_box_);
+	}
+
+private:
+	void ScrollTo(size_t line)
+	{
+		if (line < first_visible_line)
+			first_visible_line = line;
+		else if (line >= first_visible_line + visible_lines)
+			first_visible_line = line - visible_lines + 1;
+	}
+
+	bool OnEvent(Event event) override final
+	{
+		if (!event.is_mouse() || !box_.Contain(event.mouse().x, event.mouse().y) || !CaptureMouse(event))
+			return false;
+
+		// the wheel scrolls the listing, a click moves the hex editor's cursor to the clicked instruction
+		if (event.mouse().button == Mouse::WheelUp || event.mouse().button == Mouse::WheelDown)
+		{
+			const auto old_first_visible_line = first_visible_line;
+			if (event.mouse().button == Mouse::WheelUp)
+				first_visible_line -= min<size_t>(first_visible_line, 3);
+			else
+				first_visible_line += 3;
+			return first_visible_line != old_first_visible_line;
+		}
+
+		if (event.mouse().button == Mouse::Left && event.mouse().motion == Mouse::Pressed)
+		{
+			const auto y = event.mouse().y - box_.y_min - 2;
+			if (const auto line = first_visible_line + (size_t)y; y >= 0 && line < disassembly->Lines().size())
+			{
+				*hex_editor->cursor_half_byte_position = (int)disassembly->Lines()[line].address * 2;
+				hex_editor->TakeFocus();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	Box box_, view_box_;
+
+	// the window of lines on screen
+	size_t first_visible_line = 0;
+	int visible_lines = 16;
+	size_t followed_cursor_address = numeric_limits<size_t>::max();
+	optional<size_t> followed_ip_address;
+};
+
+export auto DisassemblyView(shared_ptr<Disassembly> disassembly, shared_ptr<HexEditorBase> hex_editor, DisassemblyViewOption option = DisassemblyViewOption::Default())
+{
+	option.disassembly = disassembly;
+	option.hex_editor = hex_editor;
+	return Make<DisassemblyViewBase>(move(option));
+}
+
+DisassemblyViewOption DisassemblyViewOption::Default()
+{
+	return DisassemblyViewOption();
+}
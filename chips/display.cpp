@@ -1,5 +1,6 @@
 #include "stdafx.h"
 
+import std;
 import vm;
 
 using namespace std;
@@ -11,22 +12,21 @@ void Display::Step()
 
 bool Display::ExecuteNextInstruction()
 {
-	for (auto& [index, data] : incoming_data)
-		if (data)
-			if (get<1>(*data))
+	// one message per sender and tick, whatever the queue depth
+	for (auto& [index, queue] : incoming_data)
+		if (!queue.Empty())
+			if (auto& data = queue.Front(); get<1>(data))
 			{
 				// write operation
-				if(!Memory(get<0>(*data), *get<1>(*data)))
+				if(!Memory(get<0>(data), *get<1>(data)))
 					return false;
-				incoming_data[index] = nullopt;
+				ConsumeIncomingData(index);
 			}
 			else
 			{
-				// read operation
-				auto src_vm = NetworkVM(index);
-				if (src_vm)
-					(*src_vm)->IncomingData(IndexInNetwork(), { { get<0>(*data), Memory(get<0>(*data)) } });
-				incoming_data[index] = nullopt;
+				// read operation, held back until the reply fits in the requester's queue
+				if (SendData(index, { get<0>(data), Memory(get<0>(data)) }))
+					ConsumeIncomingData(index);
 			}
 
 	return true;
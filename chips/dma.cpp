@@ -0,0 +1,55 @@
+#include "stdafx.h"
+
+import std;
+import vm;
+
+using namespace std;
+
+void DMA::Step()
+{
+	ExecuteNextInstruction();
+}
+
+bool DMA::ExecuteNextInstruction()
+{
+	// one request per sender and tick, like the memories
+	for (auto& [index, queue] : incoming_data)
+		if (!queue.Empty())
+			if (auto& data = queue.Front(); get<1>(data))
+				ConsumeIncomingData(index);
+			else if (CanSendData(index))
+			{
+				// the transfer only runs once its answer is sure to fit in the requester's queue
+				const auto status = Transfer(*NetworkVM(index), get<0>(data));
+				SendData(index, { get<0>(data), static_cast<TRegister>(status) });
+				ConsumeIncomingData(index);
+			}
+
+	return true;
+}
+
+DMAStatus DMA::Transfer(const BaseMemory& requester, size_t descriptor_address)
+{
+	array<TMemory, DescriptorSize> descriptor_buffer;
+	const auto descriptor = requester.Memory(descriptor_address, descriptor_buffer);
+	if (descriptor.size() < DescriptorSize)
+		return DMAStatus::OutOfBounds;
+
+	auto source = NetworkVM(descriptor[0]);
+	const auto source_address = ReadLittleEndian(&descriptor[1], 2);
+	auto destination = NetworkVM(descriptor[3]);
+	const auto destination_address = ReadLittleEndian(&descriptor[4], 2);
+	const auto length = ReadLittleEndian(&descriptor[6], 2);
+	if (!source || !destination)
+		return DMAStatus::NoSuchDevice;
+
+	// through a buffer, so overlapping ranges of one device copy like memmove
+	transfer_buffer.resize(length);
+	const auto bytes = source->Memory(source_address, transfer_buffer);
+	if (bytes.size() < length)
+		return DMAStatus::OutOfBounds;
+	if (bytes.data() != transfer_buffer.data())
+		ranges::copy(bytes, transfer_buffer.begin());
+
+	return destination->CopyToMemory(destination_address, transfer_buffer) ? DMAStatus::Done : DMAStatus::OutOfBounds;
+}
\ No newline at end of file
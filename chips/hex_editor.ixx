@@ -25,8 +25,13 @@ export struct HexEditorOption
 	Ref<int> bytes_per_line = 16;
 
 	Ref<int> cursor_half_byte_position{};
-	Ref<span<uint8_t>> content{};
+	// the content is only accessed through read and write, so it doesn't have to be contiguous
+	Ref<size_t> content_size{};
+	Ref<function<uint8_t(size_t)>> read{};
 	Ref<function<optional<size_t>()>> ip{};
+	Ref<function<void(size_t, uint8_t)>> write{};
+	// how hot each byte is, from 0 to 1, drawn as its background; no heatmap without it
+	Ref<function<float(size_t)>> heat{};
 };
 
 export class HexEditorBase : public ComponentBase, public HexEditorOption
@@ -42,107 +47,197 @@ public:
 		const auto is_focused = Focused();
 		const auto focused = !is_focused ? select : focusCursorUnderlineBlinking;
 
-		*cursor_half_byte_position = clamp(*cursor_half_byte_position, 0, (int)content->size() * 2);
-		auto cursor_line = *cursor_half_byte_position / (*bytes_per_line * 2);
-		auto cursor_half_column = *cursor_half_byte_position % (*bytes_per_line * 2);
+		const auto line_bytes = (size_t)*bytes_per_line;
+		const auto line_count = (*content_size + line_bytes - 1) / line_bytes;
 
-		auto ip_line = *ip ? (*ip)().value_or(-1) / *bytes_per_line : -1;
-		auto ip_column = *ip ? (*ip)().value_or(0) % *bytes_per_line : -1;
+		*cursor_half_byte_position = clamp(*cursor_half_byte_position, 0, (int)*content_size * 2);
+		const auto cursor_line = (size_t)*cursor_half_byte_position / (line_bytes * 2);
+		const auto cursor_half_column = (int)(*cursor_half_byte_position % (line_bytes * 2));
 
-		Elements elements;
-		elements.reserve((size_t)ceil(content->size() * 2.f / *bytes_per_line) + 2);
+		const auto ip_address = *ip ? (*ip)() : nullopt;
+		const auto ip_line = ip_address ? *ip_address / line_bytes : numeric_limits<size_t>::max();
+		const auto ip_column = ip_address ? (int)(*ip_address % line_bytes) : -1;
+
+		// only the lines that fit in the space we got last frame are built, following the cursor when it moves
+		if (view_box_.y_max > view_box_.y_min)
+			visible_lines = max(view_box_.y_max - view_box_.y_min + 1 - 2, 1);
+		if (*cursor_half_byte_position != scrolled_cursor_half_byte_position)
+		{
+			scrolled_cursor_half_byte_position = *cursor_half_byte_position;
+			if (cursor_line < first_visible_line)
+				first_visible_line = cursor_line;
+			else if (cursor_line >= first_visible_line + visible_lines)
+				first_visible_line = cursor_line - visible_lines + 1;
+		}
+		first_visible_line = min(first_visible_line, line_count - min(line_count, (size_t)visible_lines));
+		const auto last_visible_line = min(line_count, first_visible_line + visible_lines);
 
-		int line_length = 0;
-		string line;
+		Elements elements, line_number_elements;
+		elements.reserve(last_visible_line - first_visible_line + 2);
+		line_number_elements.reserve(last_visible_line - first_visible_line + 2);
 
 		// header
+		string header;
 		for (auto i = 0; i < *bytes_per_line; ++i)
-			line += format("{:02X} ", i);
-		elements.push_back(text(line) | dim);
+			header += format("{:02X} ", i);
+		elements.push_back(text(header) | dim);
 		elements.push_back(separator());
 
+		const auto address_digits = max<size_t>(2, (bit_width(max<size_t>(*content_size, 1) - 1) + 3) / 4);
+		line_number_elements.push_back(text(string(address_digits, ' ')));
+		line_number_elements.push_back(separator());
+
 		// data
-		line.clear();
-		auto add_line = [&]
-			{
-				if (elements.size() - 2 != cursor_line && elements.size() - 2 != ip_line)
-					elements.push_back(text(line));
-				else if (elements.size() - 2 != ip_line)
-					elements.push_back(hbox(
-						text(line.substr(0, uint64_t(cursor_half_column / 2.0 * 3.0))),
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1)))
-					));
-				else if (elements.size() - 2 != cursor_line)
-					elements.push_back(hbox(
-						text(line.substr(0, ip_column * 3)),
-						text(line.substr(ip_column * 3, 2)) | inverted,
-						text(line.substr(ip_column * 3 + 2))
-					));
-				else if (cursor_half_column / 2 >= ip_column + 1)
-					elements.push_back(hbox(
-						text(line.substr(0, ip_column * 3)),
-						text(line.substr(ip_column * 3, 2)) | inverted,
-						text(line.substr(ip_column * 3 + 2, uint64_t(cursor_half_column / 2.0 * 3.0) - ip_column * 3 - 2)),
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1)))
-					));
-				else if (cursor_half_column / 2 < ip_column)
-					elements.push_back(hbox(
-						text(line.substr(0, uint64_t(cursor_half_column / 2.0 * 3.0))),
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
-						text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1), ip_column * 3 - uint64_t(cursor_half_column / 2.0 * 3.0) - 1)),
-						text(line.substr(ip_column * 3, 2)) | inverted,
-						text(line.substr(ip_column * 3 + 2))
-					));
-				else
-					elements.push_back(hbox(
-						text(line.substr(0, ip_column * 3)),
-						cursor_half_column == ip_column * 2 + 1
-						? text(line.substr(ip_column * 3, 1)) | inverted
-						: text(line.substr(ip_column * 3, 1)) | inverted | focused,
-						cursor_half_column == ip_column * 2
-						? text(line.substr(ip_column * 3 + 1, 1)) | inverted
-						: text(line.substr(ip_column * 3 + 1, 1)) | inverted | focused,
-						text(line.substr(ip_column * 3 + 2))
-					));
-
-				line.clear();
-				line_length = 1;
-			};
-
-		for (auto&& uint8_t : *content)
+		for (auto line = first_visible_line; line < last_visible_line; ++line)
 		{
-			if (line_length++ == *bytes_per_line)
-				add_line();
-
-			if (line.size() > 0)
-				line += " ";
-			line += format("{:02X}", (unsigned char)uint8_t);
+			const auto& formatted_line = FormattedLine(line);
+			const auto line_cursor_half_column = line == cursor_line ? cursor_half_column : -1;
+			const auto line_ip_column = line == ip_line ? ip_column : -1;
+			elements.push_back(*heat
+				? HeatLineElement(formatted_line, line * line_bytes, line_cursor_half_column, line_ip_column, focused)
+				: LineElement(formatted_line, line_cursor_half_column, line_ip_column, focused));
+			line_number_elements.push_back(text(format("{:0{}X}", line * line_bytes, address_digits)) | dim);
 		}
 
-		if (line.size() > 0)
-			add_line();
-
-		// line numbers
-		Elements line_number_elements;
-		line_number_elements.reserve(elements.size());
-		line_number_elements.push_back(text("  "));
-		line_number_elements.push_back(separator());
-		for (auto i = 2; i < (int)elements.size(); ++i)
-			line_number_elements.push_back(text(format("{:02X}", (i - 2) * *bytes_per_line)) | dim);
-
 		auto element = hbox({
-			vbox(move(line_number_elements)) | yflex,
+			vbox(move(line_number_elements)),
 			separator(),
 			vbox(move(elements)) | reflect(box_) | flex,
-			}) | frame ;
+			ScrollIndicator(line_count, last_visible_line - first_visible_line),
+			}) | yframe | yflex | reflect(view_box_);
 
 		auto transform_func = transform ? transform : HexEditorOption::Default().transform;
 		return transform_func({ move(element), is_focused });
 	}
 
 private:
+	// the formatted bytes of a line, formatted again only when they differ from the ones it was formatted from
+	const string& FormattedLine(size_t line)
+	{
+		const auto line_bytes = (size_t)*bytes_per_line;
+		if (formatted_bytes.size() != *content_size || formatted_line_bytes != line_bytes)
+		{
+			formatted_bytes.assign(*content_size, 0);
+			formatted_lines.assign((*content_size + line_bytes - 1) / line_bytes, {});
+			formatted_line_bytes = line_bytes;
+		}
+
+		const auto begin = line * line_bytes;
+		const auto end = min(begin + line_bytes, *content_size);
+		auto& formatted_line = formatted_lines[line];
+		bool changed = formatted_line.empty();
+		for (auto index = begin; index < end; ++index)
+			if (const auto byte = (*read)(index); byte != formatted_bytes[index])
+			{
+				formatted_bytes[index] = byte;
+				changed = true;
+			}
+
+		if (changed)
+		{
+			constexpr char hex_digits[] = "0123456789ABCDEF";
+			formatted_line.clear();
+			for (auto index = begin; index < end; ++index)
+			{
+				if (!formatted_line.empty())
+					formatted_line += ' ';
+				formatted_line += hex_digits[formatted_bytes[index] >> 4];
+				formatted_line += hex_digits[formatted_bytes[index] & 0x0F];
+			}
+		}
+		return formatted_line;
+	}
+
+	// a line with the cursor at cursor_half_column and the byte at ip_column highlighted, -1 when they aren't on it
+	Element LineElement(const string& line, int cursor_half_column, int ip_column, Decorator focused) const
+	{
+		if (cursor_half_column < 0 && ip_column < 0)
+			return text(line);
+		else if (ip_column < 0)
+			return hbox(
+				text(line.substr(0, uint64_t(cursor_half_column / 2.0 * 3.0))),
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1)))
+			);
+		else if (cursor_half_column < 0)
+			return hbox(
+				text(line.substr(0, ip_column * 3)),
+				text(line.substr(ip_column * 3, 2)) | inverted,
+				text(line.substr(ip_column * 3 + 2))
+			);
+		else if (cursor_half_column / 2 >= ip_column + 1)
+			return hbox(
+				text(line.substr(0, ip_column * 3)),
+				text(line.substr(ip_column * 3, 2)) | inverted,
+				text(line.substr(ip_column * 3 + 2, uint64_t(cursor_half_column / 2.0 * 3.0) - ip_column * 3 - 2)),
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1)))
+			);
+		else if (cursor_half_column / 2 < ip_column)
+			return hbox(
+				text(line.substr(0, uint64_t(cursor_half_column / 2.0 * 3.0))),
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0), 1)) | focused,
+				text(line.substr(uint64_t(cursor_half_column / 2.0 * 3.0 + 1), ip_column * 3 - uint64_t(cursor_half_column / 2.0 * 3.0) - 1)),
+				text(line.substr(ip_column * 3, 2)) | inverted,
+				text(line.substr(ip_column * 3 + 2))
+			);
+		else
+			return hbox(
+				text(line.substr(0, ip_column * 3)),
+				cursor_half_column == ip_column * 2 + 1
+				? text(line.substr(ip_column * 3, 1)) | inverted
+				: text(line.substr(ip_column * 3, 1)) | inverted | focused,
+				cursor_half_column == ip_column * 2
+				? text(line.substr(ip_column * 3 + 1, 1)) | inverted
+				: text(line.substr(ip_column * 3 + 1, 1)) | inverted | focused,
+				text(line.substr(ip_column * 3 + 2))
+			);
+	}
+
+	// the same line with every byte on a background from cold to hot, built digit by digit since the colors change every frame
+	Element HeatLineElement(const string& line, size_t begin, int cursor_half_column, int ip_column, Decorator focused) const
+	{
+		Elements elements;
+		const auto columns = (int)(line.size() + 1) / 3;
+		for (int column = 0; column < columns; ++column)
+		{
+			if (column > 0)
+				elements.push_back(text(" "));
+
+			Elements digits;
+			for (int half = 0; half < 2; ++half)
+			{
+				auto digit = text(line.substr(column * 3 + half, 1));
+				if (column == ip_column)
+					digit |= inverted;
+				if (cursor_half_column == column * 2 + half)
+					digit |= focused;
+				digits.push_back(move(digit));
+			}
+
+			auto byte = hbox(move(digits));
+			if (const auto value = (*heat)(begin + column); value > 0)
+				byte |= bgcolor(Color::Interpolate(clamp(value, 0.f, 1.f), Color::RGB(0, 0, 128), Color::RGB(255, 64, 0)));
+			elements.push_back(move(byte));
+		}
+		return hbox(move(elements));
+	}
+
+	// a scroll bar beside the visible lines, nothing when they all fit
+	Element ScrollIndicator(size_t line_count, size_t shown_lines) const
+	{
+		if (shown_lines >= line_count)
+			return emptyElement();
+
+		const auto thumb_size = max<size_t>(1, shown_lines * shown_lines / line_count);
+		const auto thumb_begin = min(shown_lines - thumb_size, first_visible_line * shown_lines / line_count);
+
+		Elements elements{ text(" "), text(" ") };
+		for (size_t i = 0; i < shown_lines; ++i)
+			elements.push_back(text(i >= thumb_begin && i < thumb_begin + thumb_size ? "┃" : "│") | dim);
+		return vbox(move(elements));
+	}
+
 	bool HandleArrowLeft()
 	{
 		if (*cursor_half_byte_position > 0)
@@ -155,7 +250,7 @@ private:
 
 	bool HandleArrowRight()
 	{
-		if (*cursor_half_byte_position < (int)content->size() * 2 - 1)
+		if (*cursor_half_byte_position < (int)*content_size * 2 - 1)
 		{
 			++(*cursor_half_byte_position);
 			return true;
@@ -171,7 +266,7 @@ private:
 
 	bool HandleEnd()
 	{
-		*cursor_half_byte_position = (int)content->size() * 2 - 1;
+		*cursor_half_byte_position = (int)*content_size * 2 - 1;
 		return true;
 	}
 
@@ -185,13 +280,25 @@ private:
 		return true;
 	}
 
+	bool HandlePageUp()
+	{
+		*cursor_half_byte_position = max(*cursor_half_byte_position - visible_lines * *bytes_per_line * 2, *cursor_half_byte_position % (*bytes_per_line * 2));
+		return true;
+	}
+
+	bool HandlePageDown()
+	{
+		*cursor_half_byte_position = min(*cursor_half_byte_position + visible_lines * *bytes_per_line * 2, (int)*content_size * 2 - 1);
+		return true;
+	}
+
 	bool HandleArrowDown()
 	{
 		auto cursor_line = *cursor_half_byte_position / (*bytes_per_line * 2);
-		if (cursor_line < (int)content->size() / *bytes_per_line)
-			*cursor_half_byte_position = min(*cursor_half_byte_position + *bytes_per_line * 2, (int)content->size() * 2 - 1);
+		if (cursor_line < (int)*content_size / *bytes_per_line)
+			*cursor_half_byte_position = min(*cursor_half_byte_position + *bytes_per_line * 2, (int)*content_size * 2 - 1);
 		else
-			*cursor_half_byte_position = (int)content->size() * 2 - 1;
+			*cursor_half_byte_position = (int)*content_size * 2 - 1;
 		return true;
 	}
 
@@ -203,26 +310,37 @@ private:
 		if (!hovered_)
 			return false;
 
+		// the wheel scrolls the view, leaving the cursor where it is
+		if (event.mouse().button == Mouse::WheelUp || event.mouse().button == Mouse::WheelDown)
+		{
+			const auto old_first_visible_line = first_visible_line;
+			if (event.mouse().button == Mouse::WheelUp)
+				first_visible_line -= min<size_t>(first_visible_line, 3);
+			else
+				first_visible_line += 3;
+			return first_visible_line != old_first_visible_line;
+		}
+
 		if (event.mouse().button == Mouse::Left)
 		{
 			TakeFocus();
 
 			auto x = clamp(event.mouse().x - box_.x_min, 0, *bytes_per_line * 3 - 1);
-			auto y = event.mouse().y - box_.y_min - 2;
+			auto y = event.mouse().y - box_.y_min - 2 + (int)first_visible_line;
 
 			// last line?
-			if (y >= content->size() / *bytes_per_line)
+			if (y >= *content_size / *bytes_per_line)
 			{
-				y = (int)(content->size() / *bytes_per_line);
+				y = (int)(*content_size / *bytes_per_line);
 
 				// are we beyond the last line's width?
-				if (x >= (content->size() % *bytes_per_line) * 3)
-					x = (content->size() % *bytes_per_line) * 3 - 1;
+				if (x >= (*content_size % *bytes_per_line) * 3)
+					x = (*content_size % *bytes_per_line) * 3 - 1;
 			}
 
 			auto column = x % 3 == 0 ? x / 3 : x / 3 + 0.5f;
 
-			auto new_cursor_half_byte_position = clamp((int)(y * *bytes_per_line * 2 + column * 2), 0, (int)content->size() * 2);
+			auto new_cursor_half_byte_position = clamp((int)(y * *bytes_per_line * 2 + column * 2), 0, (int)*content_size * 2);
 			if (new_cursor_half_byte_position != *cursor_half_byte_position)
 			{
 				*cursor_half_byte_position = new_cursor_half_byte_position;
@@ -242,16 +360,23 @@ private:
 
 			auto value = (uint8_t)(ch >= 'a' ? ch - 'a' + 10 : ch >= 'A' ? ch - 'A' + 10 : ch - '0');
 
+			const auto index = *cursor_half_byte_position / 2;
 			if (*cursor_half_byte_position % 2 == 0)
-				(*content)[*cursor_half_byte_position / 2] = value << 4 | (*content)[*cursor_half_byte_position / 2] & (uint8_t)0x0F;
+				WriteByte(index, value << 4 | (*read)(index) & (uint8_t)0x0F);
 			else
-				(*content)[*cursor_half_byte_position / 2] = (*content)[*cursor_half_byte_position / 2] & (uint8_t)0xF0 | value;
+				WriteByte(index, (*read)(index) & (uint8_t)0xF0 | value);
 			HandleArrowRight();
 		}
 
 		return true;
 	}
 
+	void WriteByte(size_t index, uint8_t value)
+	{
+		if (*write)
+			(*write)(index, value);
+	}
+
 	bool HandleBackspace()
 	{
 		if (*cursor_half_byte_position == 0)
@@ -275,6 +400,10 @@ private:
 			return HandleArrowUp();
 		if (event == Event::ArrowDown)
 			return HandleArrowDown();
+		if (event == Event::PageUp)
+			return HandlePageUp();
+		if (event == Event::PageDown)
+			return HandlePageDown();
 		if (event == Event::Backspace)
 			return HandleBackspace();
 		if (event.is_mouse())
@@ -287,12 +416,23 @@ private:
 	bool Focusable() const override final { return true; }
 
 	bool hovered_ = false;
-	Box box_, cursor_box_;
+	Box box_, cursor_box_, view_box_;
+
+	// the window of lines on screen, scrolled to the cursor whenever it moved
+	size_t first_visible_line = 0;
+	int visible_lines = 16;
+	int scrolled_cursor_half_byte_position = -1;
+
+	vector<string> formatted_lines;
+	vector<uint8_t> formatted_bytes;
+	size_t formatted_line_bytes = 0;
 };
 
-export auto HexEditor(span<uint8_t> content, function<optional<size_t>()> ip, HexEditorOption option)
+export auto HexEditor(size_t content_size, function<uint8_t(size_t)> read, function<optional<size_t>()> ip, function<void(size_t, uint8_t)> write, HexEditorOption option)
 {
-	option.content = move(content);
+	option.content_size = content_size;
+	option.read = move(read);
 	option.ip = move(ip);
+	option.write = move(write);
 	return Make<HexEditorBase>(move(option));
 }
\ No newline at end of file
@@ -19,6 +19,22 @@ export struct InteractiveDisplayComponentOption
 
 export class InteractiveDisplayComponentBase : public ComponentBase, public InteractiveDisplayComponentOption
 {
+	uint64_t change_generation{};
+	Elements cells, rows;
+	Element screen;
+
+	Element RenderCell(size_t cell) const
+	{
+		// character, foreground and background
+		array<TMemory, 3> buffer;
+		const auto bytes = display->Memory(cell * 3, buffer);
+		if (bytes.size() < buffer.size())
+			return text(" ");
+
+		const auto ch = (char)bytes[0];
+		return text(string(1, ch ? ch : ' ')) | color((Color::Palette256)bytes[1]) | bgcolor((Color::Palette256)bytes[2]);
+	}
+
 public:
 	InteractiveDisplayComponentBase(InteractiveDisplayComponentOption option)
 		: InteractiveDisplayComponentOption(move(option))
@@ -27,30 +43,41 @@ public:
 
 	Element Render() override final
 	{
-		// display box
-		Elements vbox_elements;
-		vbox_elements.reserve(display->Height());
-
-		for (size_t y = 0; y < display->Height(); ++y)
+		// only the cells whose bytes were published as changed since the last frame are built again, and the rows holding them
+		const auto width = display->Width(), height = display->Height();
+		if (cells.size() != width * height)
 		{
-			Elements hbox_elements;
-			hbox_elements.reserve(display->Width());
-			for (size_t x = 0; x < display->Width(); ++x)
-			{
-				const auto ch = (char)display->Memory(y * display->Width() * 3 + x * 3);
-				const auto fg = (Color::Palette256)display->Memory(y * display->Width() * 3 + x * 3 + 1);
-				const auto bg = (Color::Palette256)display->Memory(y * display->Width() * 3 + x * 3 + 2);
+			cells.assign(width * height, nullptr);
+			rows.assign(height, nullptr);
+			screen = nullptr;
+			change_generation = 0;
+		}
 
-				hbox_elements.push_back(text(format("{}", ch ? ch : ' '))
-					| color(fg) | bgcolor(bg));
+		const auto changes = display->ChangesSince(change_generation);
+		for (auto&& [begin, end] : changes.memory_ranges)
+			for (auto cell = begin / 3; cell < min(cells.size(), (end + 2) / 3); ++cell)
+			{
+				cells[cell] = RenderCell(cell);
+				rows[cell / width] = nullptr;
 			}
-			vbox_elements.push_back(hbox(move(hbox_elements)));
+
+		if (!screen || ranges::any_of(rows, [](auto&& row) { return !row; }))
+		{
+			for (size_t y = 0; y < height; ++y)
+				if (!rows[y])
+				{
+					for (size_t x = 0; x < width; ++x)
+						if (!cells[y * width + x])
+							cells[y * width + x] = RenderCell(y * width + x);
+					rows[y] = hbox(Elements(cells.begin() + y * width, cells.begin() + (y + 1) * width));
+				}
+			screen = vbox(rows) | borderRounded;
 		}
 
 		return vbox({
 			hbox({
 				filler(),
-				vbox(move(vbox_elements)) | borderRounded,
+				screen,
 				filler(),
 				}),
 			text(format("{}/{} {}", display->IndexInNetwork(), display->NetworkIndex(), display->Name())) | color(Color::Aquamarine1) | hcenter,
@@ -1,19 +1,28 @@
 ﻿#include "stdafx.h"
 
 import std.core;
+import std.threading;
 import vm;
 import vm_machines;
+import disassembly;
 import hex_editor;
+import disassembly_view;
 import registers_view;
 import memory_details_view;
 import interactive_vm_component;
 import interactive_display_component;
 import puzzle;
+import puzzle_runner;
+import puzzle_validation;
 import puzzles;
 
 using namespace std;
 using namespace ftxui;
 
+// a passing solution is scored over this many seeds, giving up on a seed after this many steps
+static constexpr size_t ScoreSeedCount = 64;
+static constexpr size_t ScoreMaxSteps = 100'000;
+
 static Element GetVmHexEditorWindowTitle(const shared_ptr<BaseMemory>& vm)
 {
 	return hbox({
@@ -28,9 +37,9 @@ static Element GetVmHexEditorWindowTitle(const shared_ptr<BaseMemory>& vm)
 static Component MakeDocumentationComponent(shared_ptr<VM> vm)
 {
 	Elements vbox_elements;
-	for (auto&& [opcode, instruction] : vm->Instructions())
+	for (auto&& instruction : vm->Instructions())
 	{
-		vbox_elements.push_back(instruction.description_element);
+		vbox_elements.push_back(BuildMarkupElement(instruction.description_markup));
 		vbox_elements.push_back(separatorLight());
 	}
 	auto result = vbox(vbox_elements);
@@ -38,18 +47,60 @@ static Component MakeDocumentationComponent(shared_ptr<VM> vm)
 	return Scroller(Renderer([=] { return result; }));
 }
 
+// what the hex editor's heatmap shows, log scaled to the hottest byte; choosing any turns profiling on from the next run
+static Component MakeHeatmapSelection(shared_ptr<VM> vm, shared_ptr<HexEditorBase> hex_editor)
+{
+	static const vector<string> heatmap_names{ "Off", "Steps", "Reads", "Writes" };
+	// kept alive by the menu's on_change
+	auto selected_heatmap = make_shared<int>(0);
+
+	auto option = MenuOption::Toggle();
+	option.on_change = [vm, hex_editor, selected_heatmap]
+		{
+			vm->Profiling(*selected_heatmap != 0);
+			if (!*selected_heatmap)
+			{
+				*hex_editor->heat = nullptr;
+				return;
+			}
+
+			*hex_editor->heat = [vm, selected_heatmap](size_t index) -> float
+				{
+					const auto profile = vm->Profile();
+					if (!profile || index >= profile->executions.size())
+						return 0;
+
+					const auto [counts, max_count] =
+						*selected_heatmap == 1 ? pair{ &profile->executions, profile->max_executions }
+						: *selected_heatmap == 2 ? pair{ &profile->reads, profile->max_reads }
+						: pair{ &profile->writes, profile->max_writes };
+					return max_count ? static_cast<float>(log1p((*counts)[index]) / log1p(max_count)) : 0.f;
+				};
+		};
+
+	return Container::Horizontal({
+		Renderer([] { return text("Heatmap: ") | dim; }),
+		Menu(&heatmap_names, selected_heatmap.get(), option),
+		});
+}
+
 static Component MakeVmContainer(shared_ptr<PuzzleInstance> puzzle, shared_ptr<VM> vm, bool& success, bool& show_documentation)
 {
-	auto hex_editor = HexEditor(vm->Memory(), [=] { return puzzle->State() == PuzzleState::Edit ? nullopt : make_optional(vm->IP()); },
-		HexEditorOption::BytesPerLine(16));
-	auto memory_details_view = MemoryDetailsView(puzzle, vm, hex_editor, MemoryDetailsViewOption::Default());
+	auto hex_editor = HexEditor(vm->MemorySize(), [=](size_t index) { return vm->Memory(index); }, [=] { return puzzle->State() == PuzzleState::Edit ? nullopt : make_optional(vm->IP()); },
+		[=](size_t index, uint8_t value) { vm->Memory(index, value); puzzle->RestartHistory(); }, HexEditorOption::BytesPerLine(16));
+	auto disassembly = make_shared<Disassembly>(vm);
+	auto disassembly_view = DisassemblyView(disassembly, hex_editor);
+	auto memory_details_view = MemoryDetailsView(puzzle, vm, hex_editor, disassembly, MemoryDetailsViewOption::Default());
 	auto register_view = RegistersView(vm, RegistersViewOption::Default());
 
 	auto hex_editor_window_with_documentation = Container::Horizontal({
 		hex_editor | xflex_shrink,
 		Renderer([] { return separator(); }),
+		disassembly_view | size(WIDTH, EQUAL, 22),
+		Renderer([] { return separator(); }),
 		Container::Vertical({
 			Checkbox("Documentation", &show_documentation),
+			MakeHeatmapSelection(vm, hex_editor),
 			Renderer([] { return separator(); }),
 			MakeDocumentationComponent(vm) | Maybe([&] { return show_documentation; }),
 			}) | xflex,
@@ -89,18 +140,56 @@ static Component MakeReadOnlyVmContainer(shared_ptr<BaseMemory> vm)
 		});
 }
 
-static Component MakeSuccessModal(bool& success, bool& show_puzzle_selection)
+// the solution's score over the seeds it was validated on, with how each measure spread over them
+static Element MakeScoreElement(const PuzzleValidationResult& validation)
+{
+	const auto& score = validation.score;
+	const auto row = [](const char* name, const PuzzleStatistic& statistic) -> Elements
+		{
+			return {
+				text(name) | dim,
+				text(format(" {:.0f}", statistic.min)) | align_right,
+				text(format(" {:.0f}", statistic.median)) | align_right,
+				text(format(" {:.1f}", statistic.average)) | align_right,
+				text(format(" {:.0f}", statistic.p90)) | align_right,
+				text(format(" {:.0f}", statistic.max)) | align_right,
+			};
+		};
+
+	return vbox({
+		text(format("{} seeds, {:.0f}% passed", validation.seed_results.size(), validation.pass_rate * 100)),
+		text(format("Program size: {} bytes", score.program_size)),
+		separatorEmpty(),
+		gridbox({
+			{ text(""), text(" min") | dim | align_right, text(" median") | dim | align_right, text(" avg") | dim | align_right,
+				text(" p90") | dim | align_right, text(" max") | dim | align_right },
+			row("Steps", score.steps),
+			row("Messages", score.messages_sent),
+			row("Failed sends", score.failed_sends),
+			row("Peak queue", score.peak_queue_occupancy),
+			}),
+		});
+}
+
+// shown while the solution is still being scored in the background
+static Element MakeScoringElement(size_t validated_seeds)
+{
+	return vbox({
+		text(format("Scoring over {} seeds... {}/{}", ScoreSeedCount, validated_seeds, ScoreSeedCount)) | dim,
+		gauge(static_cast<float>(validated_seeds) / ScoreSeedCount),
+		});
+}
+
+static Component MakeSuccessModal(bool& success, bool& show_puzzle_selection, const optional<PuzzleValidationResult>& validation,
+	const atomic<size_t>& validated_seeds)
 {
 	auto sucess_modal_window_actions = Container::Horizontal({
 		Button("OK", [&] { success = false; show_puzzle_selection = true; }, ButtonOption::Animated(Color::LightGreen)),
 		});
-	auto success_modal_window = Renderer(sucess_modal_window_actions, [=] { return window(
+	auto success_modal_window = Renderer(sucess_modal_window_actions, [=, &validation, &validated_seeds] { return window(
 		text("Level completed!") | hcenter | bold,
 		vbox({
-			text("Details NYI"),
-			text("Details NYI"),
-			text("Details NYI"),
-			text("Details NYI"),
+			validation ? MakeScoreElement(*validation) : MakeScoringElement(validated_seeds),
 			separator(),
 			sucess_modal_window_actions->Render() | center,
 			}));
@@ -114,7 +203,7 @@ static Component MakePuzzleSelectionModal(const vector<string>& puzzle_names, in
 
 	Components puzzle_tab_components;
 	for (auto& puzzle : Puzzles)
-		puzzle_tab_components.push_back(Renderer([&] { return puzzle.description_element; }));
+		puzzle_tab_components.push_back(Renderer([description_element = BuildMarkupElement(puzzle.description_markup)] { return description_element; }));
 	auto puzzle_tab_contents = Container::Tab(puzzle_tab_components, &selected_puzzle);
 
 	return Window(WindowOptions{
@@ -162,8 +251,9 @@ static Component MakeInteractiveView(shared_ptr<PuzzleInstance> puzzle)
 		container->Render() | center); });
 }
 
-static Component MakeShell(int& selected_vm, bool& success, shared_ptr<PuzzleInstance> puzzle, int& selected_puzzle, bool& show_puzzle_selection,
-	const vector<string>& puzzle_names, vector<string>& vm_tab_names, bool& show_documentation)
+static Component MakeShell(int& selected_vm, bool& success, shared_ptr<PuzzleInstance> puzzle, shared_ptr<PuzzleRunner> runner, int& selected_puzzle, bool& show_puzzle_selection,
+	const vector<string>& puzzle_names, vector<string>& vm_tab_names, bool& show_documentation, const vector<string>& run_speed_names, int& selected_run_speed,
+	const optional<PuzzleValidationResult>& validation, const atomic<size_t>& validated_seeds)
 {
 	Component shell;
 	if (puzzle)
@@ -186,6 +276,10 @@ static Component MakeShell(int& selected_vm, bool& success, shared_ptr<PuzzleIns
 		vm_tab_names.push_back("Interactive");
 		auto vm_tab = Menu(&vm_tab_names, &selected_vm);
 
+		auto run_speed_option = MenuOption::Toggle();
+		run_speed_option.on_change = [runner, &selected_run_speed] { runner->Speed(static_cast<RunSpeed>(selected_run_speed)); };
+		auto run_speed = Menu(&run_speed_names, &selected_run_speed, run_speed_option);
+
 		auto main_content = Container::Horizontal({
 			vm_tab_contents,
 			Renderer([] { return separatorHeavy(); }),
@@ -199,18 +293,25 @@ static Component MakeShell(int& selected_vm, bool& success, shared_ptr<PuzzleIns
 		shell = Container::Vertical({
 			main_content | flex,
 			Renderer([] { return separatorHeavy(); }),
+			Renderer([puzzle] { return text(puzzle->StallDiagnostic()) | color(Color::Red); })
+				| Maybe([puzzle] { return puzzle->State() == PuzzleState::Paused && puzzle->Stalled(); }),
 			Container::Horizontal({
-				Button("Run", [puzzle] { puzzle->Run(); }, ButtonOption::Animated(Color::LightGreen)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Running; }),
-				Button("Pause", [puzzle] { puzzle->Pause(); }, ButtonOption::Animated(Color::LightGreen)) | Maybe([puzzle] { return puzzle->State() == PuzzleState::Running; }),
-				Button("Step", [puzzle] { puzzle->Step(); }, ButtonOption::Animated(Color::Aquamarine1)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Running; }),
-				Button("Stop", [puzzle] { puzzle->Stop(); }, ButtonOption::Animated(Color::Red)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Edit; }),
+				Button("Run", [runner] { runner->Run(); }, ButtonOption::Animated(Color::LightGreen)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Running; }),
+				Button("Pause", [runner] { runner->Pause(); }, ButtonOption::Animated(Color::LightGreen)) | Maybe([puzzle] { return puzzle->State() == PuzzleState::Running; }),
+				Button("Back", [runner] { runner->StepBack(); }, ButtonOption::Animated(Color::Aquamarine1))
+					| Maybe([puzzle] { return puzzle->State() == PuzzleState::Paused && puzzle->Steps() > puzzle->HistoryStart(); }),
+				Button("Step", [runner] { runner->Step(); }, ButtonOption::Animated(Color::Aquamarine1)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Running; }),
+				Button("Stop", [runner] { runner->Stop(); }, ButtonOption::Animated(Color::Red)) | Maybe([puzzle] { return puzzle->State() != PuzzleState::Edit; }),
 				Renderer([] { return separatorHeavy(); }),
-				Renderer([puzzle] { return puzzle->PuzzleTemplate().description_element | vcenter; }),
+				Renderer([] { return text("Speed:") | dim | vcenter; }),
+				run_speed | vcenter,
+				Renderer([] { return separatorHeavy(); }),
+				Renderer([description_element = BuildMarkupElement(puzzle->PuzzleTemplate().description_markup)] { return description_element | vcenter; }),
 				}),
 			Renderer([] { return separatorHeavy(); }),
 			});
 
-		shell |= Modal(MakeSuccessModal(success, show_puzzle_selection), &success);
+		shell |= Modal(MakeSuccessModal(success, show_puzzle_selection, validation, validated_seeds), &success);
 	}
 	else
 		shell = Renderer([] { return text(""); });
@@ -226,45 +327,120 @@ int main()
 	screen.dimx();
 
 	shared_ptr<PuzzleInstance> puzzle;
+	shared_ptr<PuzzleRunner> runner;
 
 	bool success = false;
+	// the score of the last solution to pass, run over a batch of seeds on a background thread once the checks passed;
+	// the main loop picks the result up when it's ready, and requests a frame whenever another seed is done
+	optional<PuzzleValidationResult> validation;
+	future<PuzzleValidationResult> pending_validation;
+	stop_source validation_stop;
+	atomic<size_t> validated_seeds = 0;
+	size_t drawn_validated_seeds = 0;
 	bool show_documentation = false;
 	int selected_vm = 0;
 	int selected_puzzle = -1;
 	bool show_puzzle_selection = true;
 	auto puzzle_names = Puzzles | ranges::views::transform([](const auto& puzzle) { return puzzle.name; }) | ranges::to<vector<string>>();
 	vector<string> vm_tab_names;
+	const auto run_speed_names = RunSpeedNames();
+	int selected_run_speed = static_cast<int>(RunSpeed::Normal);
 
 	Component shell;
 
 	unique_ptr<Loop> loop;
 
+	// a solution nobody waits for the score of anymore only finishes the seeds it started
+	auto cancel_validation = [&] {
+		if (pending_validation.valid())
+		{
+			validation_stop.request_stop();
+			pending_validation = {};
+			validation_stop = {};
+		}
+		};
+
 	auto load_puzzle = [&] {
+		cancel_validation();
 		if (selected_puzzle >= 0)
+		{
 			puzzle = Puzzles[selected_puzzle].make();
+			puzzle->EnableHistory();
+		}
 		else
 			puzzle = nullptr;
+		runner = puzzle ? make_shared<PuzzleRunner>(puzzle) : nullptr;
+		if (runner)
+			runner->Speed(static_cast<RunSpeed>(selected_run_speed));
 
 		show_puzzle_selection = !puzzle;
 		selected_vm = 0;
 
-		shell = MakeShell(selected_vm, success, puzzle, selected_puzzle, show_puzzle_selection, puzzle_names, vm_tab_names, show_documentation);
+		shell = MakeShell(selected_vm, success, puzzle, runner, selected_puzzle, show_puzzle_selection, puzzle_names, vm_tab_names, show_documentation, run_speed_names, selected_run_speed, validation, validated_seeds);
 		loop = make_unique<Loop>(&screen, shell);
 		};
 	load_puzzle();
 
 	// append listeners to global events of interest to the UI
 	GlobalEventQueue.appendListener(GlobalEventType::VMDirty, [&](const TGlobalEventSource) { screen.RequestAnimationFrame(); });
-	GlobalEventQueue.appendListener(GlobalEventType::PuzzleSuccess, [&](const TGlobalEventSource) { success = true; screen.RequestAnimationFrame(); });
+	GlobalEventQueue.appendListener(GlobalEventType::PuzzleSuccess, [&](const TGlobalEventSource) {
+		runner->Stop();
+
+		// the player can edit the puzzle again as soon as the modal closes, so the validation works off its own copy of the solution
+		shared_ptr solution = puzzle->PuzzleTemplate().make();
+		CopySolution(*puzzle)(*solution);
+
+		cancel_validation();
+		validation.reset();
+		validated_seeds = drawn_validated_seeds = 0;
+		pending_validation = async(launch::async, [&puzzle_template = puzzle->PuzzleTemplate(), solution, &validated_seeds, stop = validation_stop.get_token()] {
+			return ValidatePuzzle(puzzle_template, CopySolution(*solution), 0, ScoreSeedCount, ScoreMaxSteps, max(thread::hardware_concurrency(), 1u),
+				&validated_seeds, stop);
+			});
+		success = true;
+		screen.RequestAnimationFrame();
+		});
+	GlobalEventQueue.appendListener(GlobalEventType::PuzzleStalled, [&](const TGlobalEventSource) {
+		runner->Pause();
+		screen.RequestAnimationFrame();
+		});
 	GlobalEventQueue.appendListener(GlobalEventType::LoadNewPuzzle, [&](const TGlobalEventSource) { load_puzzle(); });
 
 	while (!loop->HasQuitted())
 	{
-		loop->RunOnce();
+		{
+			// the runner ticks on its own thread, hold it between two batches while the UI draws and edits the puzzle
+			optional<PuzzleRunner::ReadLock> read_lock;
+			if (runner)
+				read_lock.emplace(runner);
+
+			loop->RunOnce();
+
+			// a running puzzle publishes its own changes every tick, otherwise pick up edits once per frame
+			if (runner && puzzle->State() != PuzzleState::Running)
+				runner->PublishChanges();
+		}
 
 		// process event queues
 		GlobalEventQueue.process();
+
+		if (pending_validation.valid())
+		{
+			if (!success)
+				cancel_validation();
+			else if (pending_validation.wait_for(0s) == future_status::ready)
+			{
+				validation = pending_validation.get();
+				screen.RequestAnimationFrame();
+			}
+			else if (const size_t seeds = validated_seeds; seeds != drawn_validated_seeds)
+			{
+				drawn_validated_seeds = seeds;
+				screen.RequestAnimationFrame();
+			}
+		}
 	}
 
+	cancel_validation();
 	return 0;
 }
\ No newline at end of file
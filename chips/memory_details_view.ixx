@@ -5,6 +5,7 @@ module;
 export module memory_details_view;
 
 import std.core;
+import disassembly;
 import hex_editor;
 import puzzle;
 import vm;
@@ -19,6 +20,8 @@ export struct MemoryDetailsViewOption
 	shared_ptr<PuzzleInstance> puzzle;
 	shared_ptr<VM> vm;
 	shared_ptr<HexEditorBase> hex_editor;
+	// where the instructions' text comes from, shared with the disassembly view
+	shared_ptr<Disassembly> disassembly;
 };
 
 export class MemoryDetailsViewBase : public ComponentBase, public MemoryDetailsViewOption
@@ -31,41 +34,80 @@ public:
 
 	Element Render() override final
 	{
+		disassembly->Update();
 		auto selected_address = *hex_editor->cursor_half_byte_position / 2;
 		if (puzzle->State() == PuzzleState::Edit)
 			return hbox(
 				text("SL@") | dim,
-				text(format("{:#04x}", selected_address)),
+				text(format("{:#0{}x}", selected_address, 2 + vm->AddressBytes() * 2)),
 				separatorLight(),
-				text(vm->DecodeInstruction(selected_address).value_or("???"))
+				text(disassembly->InstructionText(selected_address).value_or("???"))
 			);
 
-		return hbox(
+		auto details = hbox(
 			vbox(
 				hbox(
 					text("IP@") | dim,
-					text(format("{:#04x}", vm->IP()))
+					text(format("{:#0{}x}", vm->IP(), 2 + vm->AddressBytes() * 2))
 				),
 				hbox(
 					text("SL@") | dim,
-					text(format("{:#04x}", selected_address))
+					text(format("{:#0{}x}", selected_address, 2 + vm->AddressBytes() * 2))
 				)
 			),
 			separatorLight(),
 			vbox(
-				text(vm->DecodeInstruction(vm->IP()).value_or("???")),
-				text(vm->DecodeInstruction(selected_address).value_or("???"))
+				text(disassembly->InstructionText(vm->IP()).value_or("???")),
+				text(disassembly->InstructionText(selected_address).value_or("???"))
 			)
 		);
+		if (auto profile = vm->Profile())
+			return hbox(move(details), separatorLight(), ProfileSummary(*profile, selected_address));
+		return details;
+	}
+
+private:
+	// the profiled run's totals and the selected address' counts, beside the most executed instructions
+	Element ProfileSummary(const VMProfile& profile, size_t selected_address) const
+	{
+		const auto share = [&](uint64_t count) { return format("{} ({:.1f}%)", count, profile.steps ? count * 100.0 / profile.steps : 0.0); };
+
+		vector<Elements> totals{
+			{ text("steps ") | dim, text(format("{}", profile.steps)) },
+			{ text("IN waits ") | dim, text(share(profile.in_stalls)) },
+			{ text("OUT fails ") | dim, text(share(profile.out_failures)) },
+			{ text("XFER waits ") | dim, text(share(profile.xfer_stalls)) },
+		};
+		if (selected_address < profile.executions.size())
+			totals.push_back({ text("SL ") | dim, text(format("{}x r{} w{}", profile.executions[selected_address],
+				profile.reads[selected_address], profile.writes[selected_address])) });
+
+		// by first opcode byte, which is all the profiler tells apart
+		vector<pair<uint64_t, TMemory>> opcodes;
+		for (size_t opcode = 0; opcode < profile.opcode_executions.size(); ++opcode)
+			if (profile.opcode_executions[opcode])
+				opcodes.emplace_back(profile.opcode_executions[opcode], static_cast<TMemory>(opcode));
+		ranges::sort(opcodes, greater{});
+		opcodes.resize(min(opcodes.size(), totals.size()));
+
+		vector<Elements> instructions;
+		for (auto& [count, opcode] : opcodes)
+		{
+			auto it = ranges::find_if(vm->Instructions(), [opcode](auto&& instruction) { return instruction.base_opcode.front() == opcode; });
+			instructions.push_back({ text(format("{} ", it != vm->Instructions().end() ? it->name : "???")) | dim, text(share(count)) });
+		}
+
+		return hbox(gridbox(move(totals)), separatorLight(), gridbox(move(instructions)));
 	}
 };
 
 export auto MemoryDetailsView(shared_ptr<PuzzleInstance> puzzle, shared_ptr<VM> vm,
-	shared_ptr<HexEditorBase> hex_editor, MemoryDetailsViewOption option)
+	shared_ptr<HexEditorBase> hex_editor, shared_ptr<Disassembly> disassembly, MemoryDetailsViewOption option)
 {
 	option.puzzle = puzzle;
 	option.vm = vm;
 	option.hex_editor = hex_editor;
+	option.disassembly = disassembly;
 	return Make<MemoryDetailsViewBase>(move(option));
 }
 
@@ -4,12 +4,12 @@ module;
 
 export module puzzle;
 
-import std.core;
+import std;
 import vm;
 import vm_machines;
+import thread_pool;
 
 using namespace std;
-using namespace ftxui;
 
 export enum class PuzzleState
 {
@@ -18,30 +18,77 @@ export enum class PuzzleState
 	Paused
 };
 
+export struct PuzzleRunResult
+{
+	bool passed{};
+	size_t steps{};
+	chrono::nanoseconds wall_time{};
+	vector<string> errors;
+	// why the run ended before max_steps without passing, when it stalled; empty otherwise
+	string stall;
+	// every device's traffic added up, the peak being the highest of any queue
+	NetworkTraffic traffic;
+};
+
+// checkpoints every checkpoint_interval ticks, keeping at most max_checkpoints of them by doubling the interval
+// whenever there would be more; going back costs at most one interval of ticks, usually much less
+export struct PuzzleHistoryOptions
+{
+	size_t checkpoint_interval = 256;
+	size_t max_checkpoints = 64;
+};
+
 export struct PuzzleInstance;
 
+// bytes [begin, end) of the device at index device of a puzzle instance
+export struct PuzzleWatch
+{
+	size_t device;
+	size_t begin, end;
+};
+
+// a check that only depends on the watched bytes, so it is re-evaluated when one of them changes value;
+// a check without watches is evaluated after every tick
+export struct PuzzleCheck
+{
+	function<bool(PuzzleInstance& puzzle_instance)> check;
+	vector<PuzzleWatch> watches;
+
+	template<typename TFunc>
+		requires convertible_to<TFunc, function<bool(PuzzleInstance&)>>
+	PuzzleCheck(TFunc&& check, vector<PuzzleWatch> watches = {})
+		: check(forward<TFunc>(check)), watches(move(watches))
+	{
+	}
+};
+
 export struct Puzzle
 {
 	using TNetwork = vector<shared_ptr<BaseMemory>>;
 	using TMakeNetwork = vector<tuple<string, function<shared_ptr<BaseMemory>()>, bool, vector<uint8_t>>>;
-	using TCheck = function<bool(PuzzleInstance& puzzle_instance)>;
+	using TCheck = PuzzleCheck;
 	using TSetup = function<void(PuzzleInstance& puzzle_instance)>;
 
 	function<shared_ptr<PuzzleInstance>()> make;
 	string name;
-	Element description_element;
+	string description_markup;
 
 	vector<TCheck> checks;
 	TSetup setup;
 	vector<TMakeNetwork> internal_make_networks;
 
+	// how many messages a device can queue towards another one before OUT and IN requests start failing
+	size_t network_queue_depth;
+
 	Puzzle(const vector<TMakeNetwork>& make_networks,
 		const string& name_markup, const string& description_markup,
-		const TSetup setup, const vector<TCheck>& checks);
+		const TSetup setup, const vector<TCheck>& checks, size_t network_queue_depth = 1);
 };
 
 export struct PuzzleInstance
 {
+	using TRandomEngine = mt19937_64;
+
 	PuzzleInstance(Puzzle& puzzle, const vector<shared_ptr<BaseMemory>>& vms);
 
 	shared_ptr<BaseMemory> VM(size_t index) { return vms[index]; }
@@ -65,33 +112,160 @@ export struct PuzzleInstance
 
 	Puzzle& PuzzleTemplate() const { return puzzle; }
 
+	// ticks since the run was set up
+	size_t Steps() const { return steps; }
+
+	// the bytes of the editable devices up to the last non-zero one in each, which is how long the player's programs are
+	size_t ProgramSize() const
+	{
+		size_t size = 0;
+		for (auto& vm : vms)
+			if (vm->Editable())
+				for (auto index = vm->MemorySize(); index > 0; --index)
+					if (vm->Memory(index - 1))
+					{
+						size += index;
+						break;
+					}
+		return size;
+	}
+
+	// the puzzle setup draws its random inputs from Random(), whose engine every SetupForRun reseeds from Seed()
+	auto Seed() const { return seed; }
+	void Seed(uint64_t value) { seed = value; }
+	TRandomEngine& RandomEngine() { return random_engine; }
+
+	// a value in [low, high] mapped straight from the engine's raw output, which the standard fixes; the standard
+	// distributions are left to each library, so they would give other inputs for the same seed on another compiler
+	uint64_t Random(uint64_t low, uint64_t high) { return low + random_engine() % (high - low + 1); }
+
+	// steps the devices of each tick on this pool instead of in order, with identical results; null to step them serially
+	void DeviceThreadPool(ThreadPool* value) { device_thread_pool = value; }
+
+	// from the next setup on, finds the VMs going around a loop nothing reaches, which park instead of stepping with the same
+	// results unless history is recorded, which keeps every tick's state; either way a run that stalled is reported
+	void DetectLoops(bool value) { detect_loops = value; }
+	// whether the last tick left the run unable to change anymore: every active device going around a loop nothing
+	// reaches, no memory with a message to handle, and the current check already failed on memory that stays as it is
+	bool Stalled() const { return stalled; }
+	// what each device was doing when the run stalled
+	string StallDiagnostic() const;
+	// wakes every parked device, leaving each where stepping would have
+	void ResumeParkedDevices();
+
+	// records the runs from now on, so they can be stepped back and jumped around in
+	void EnableHistory(PuzzleHistoryOptions options = {}) { history = options; }
+	// forgets the run before the current step, for when its state was changed from outside, like a memory edit
+	void RestartHistory();
+	// the earliest step the history can go back to
+	size_t HistoryStart() const { return checkpoints.empty() ? steps : checkpoints.front().steps; }
+
+	// moves a paused or running run to another step, backwards through the history or forwards by ticking
+	bool StepBack(size_t count = 1) { return JumpTo(steps - min(count, steps - HistoryStart())); }
+	bool JumpTo(size_t step);
+
 	void SetupForRun();
 	void Run();
-	void Step();
+	bool Step();
 	void Pause();
 	void Stop();
 
+	// steps every device once and evaluates the checks, returns true once all of them passed;
+	// a message sent during a tick is handled by a memory at the end of that tick, and seen by any other device on the next one
+	bool Tick();
+
+	// runs from a fresh setup until the checks pass, the run stalls or max_steps ticks elapsed, as fast as possible: while
+	// a single device is stepping and nothing else has anything to do, it steps alone for as many ticks as it can
+	PuzzleRunResult RunToCompletion(size_t max_steps);
+
 private:
 	Puzzle& puzzle;
 	int check_index{};
+	size_t steps{};
 	vector<shared_ptr<BaseMemory>> vms;
+	vector<BaseMemory*> active_devices, passive_devices;
+
+	// the scheduler: the active devices stepped each tick, and the ones parked with the step they parked at and their
+	// activity then, until it changes
+	struct ParkedDevice
+	{
+		BaseMemory* device;
+		size_t since_step;
+		uint64_t activity;
+	};
+	bool detect_loops = true, parking{}, stalled{};
+	vector<BaseMemory*> ready_devices;
+	vector<ParkedDevice> parked_devices;
+
+	uint64_t seed{};
+	TRandomEngine random_engine;
+
+	ThreadPool* device_thread_pool{};
+
+	struct Checkpoint
+	{
+		size_t steps;
+		int check_index;
+		vector<DeviceCheckpoint> devices;
+	};
+	optional<PuzzleHistoryOptions> history;
+	size_t checkpoint_interval{};
+	vector<Checkpoint> checkpoints;
+	vector<int> undo_check_indices;
+
+	// the ticks the only ready device stepped alone for, with the same results as ticking, 0 when more than it could change
+	size_t TickAlone(size_t max_ticks);
+	// evaluates the checks after a tick and whether it stalled the run, returns true once all of them passed
+	bool CheckTick();
+
+	void TakeCheckpoint();
+	void RestoreCheckpoint(const Checkpoint& checkpoint);
+	void UndoTick();
+	void ClearHistory();
 
 	atomic<PuzzleState> state = PuzzleState::Edit;
-	SDL_TimerID timer{};
+
+	// whether the current check has to be evaluated even though none of its watched bytes changed
+	bool check_dirty = true;
+
+	void WatchCurrentCheck()
+	{
+		for (auto& vm : vms)
+			vm->ClearMemoryWatches();
+		if (check_index < puzzle.checks.size())
+			for (auto& watch : puzzle.checks[check_index].watches)
+				vms[watch.device]->WatchMemory(watch.begin, watch.end);
+		check_dirty = true;
+	}
 
 	bool RunChecks()
 	{
-		if (check_index < puzzle.checks.size() && puzzle.checks[check_index](*this))
+		if (check_index == puzzle.checks.size())
+			return true;
+
+		auto& check = puzzle.checks[check_index];
+		bool changed = check_dirty || check.watches.empty();
+		for (auto& vm : vms)
+			changed |= vm->TakeWatchedMemoryChanged();
+		if (!changed)
+			return false;
+
+		check_dirty = false;
+		if (check.check(*this))
+		{
 			++check_index;
+			WatchCurrentCheck();
+		}
 		return check_index == puzzle.checks.size();
 	}
 };
 
 inline Puzzle::Puzzle(const vector<TMakeNetwork>& make_networks,
 	const string& name, const string& description_markup,
-	const TSetup setup, const vector<TCheck>& checks) : name(name)
+	const TSetup setup, const vector<TCheck>& checks, size_t network_queue_depth)
+	: name(name), network_queue_depth(network_queue_depth)
 {
-	description_element = BuildMarkupElement(description_markup);
+	this->description_markup = description_markup;
 
 	internal_make_networks = make_networks;
 	this->checks = checks;
@@ -124,15 +298,15 @@ inline Puzzle::Puzzle(const vector<TMakeNetwork>& make_networks,
 				| ranges::views::join
 				| ranges::to<vector<shared_ptr<BaseMemory>>>();
 
+			auto topology = make_shared<NetworkTopology>();
 			for (auto&& vm : vms)
-				for (auto&& vm2 : vms)
-					if (vm != vm2)
-					{
-						vm->AddNetworkedVM(vm2->NetworkIndex(), vm2->IndexInNetwork(), vm2);
-						vm2->AddNetworkedVM(vm->NetworkIndex(), vm->IndexInNetwork(), vm);
-					}
-					else
-						vm->AddNetworkedVM(vm->NetworkIndex(), vm->IndexInNetwork(), vm);
+				topology->Add(*vm);
+
+			for (auto&& vm : vms)
+			{
+				vm->Topology(topology);
+				vm->NetworkQueueDepth(this->network_queue_depth);
+			}
 
 			return make_shared<PuzzleInstance>(*this, vms);
 		};
@@ -141,23 +315,212 @@ inline Puzzle::Puzzle(const vector<TMakeNetwork>& make_networks,
 inline PuzzleInstance::PuzzleInstance(Puzzle& puzzle, const vector<shared_ptr<BaseMemory>>& vms)
 	: puzzle(puzzle), vms(vms)
 {
-	GlobalEventQueue.appendListener(GlobalEventType::VMInstructionExecuted, [&](TGlobalEventSource)
-		{
-			if (RunChecks())
-			{
-				Stop();
-				GlobalEventQueue.enqueue(GlobalEventType::PuzzleSuccess, this);
-			}
-		});
+	for (auto& vm : vms)
+		(vm->Passive() ? passive_devices : active_devices).push_back(vm.get());
+	ready_devices = active_devices;
 }
 
 inline void PuzzleInstance::SetupForRun()
 {
+	parking = detect_loops && !history;
 	for (auto& vm : vms)
+	{
 		vm->SetupForRun();
+		vm->DetectLoops(detect_loops, parking);
+	}
+	ready_devices = active_devices;
+	parked_devices.clear();
+	stalled = false;
 
 	check_index = 0;
+	steps = 0;
+	random_engine.seed(seed);
 	puzzle.setup(*this);
+	WatchCurrentCheck();
+
+	ClearHistory();
+	if (history)
+	{
+		checkpoint_interval = max<size_t>(history->checkpoint_interval, 1);
+		TakeCheckpoint();
+	}
+}
+
+inline void PuzzleInstance::TakeCheckpoint()
+{
+	// ticking forwards again after going back passes checkpoints that are still valid, the run being deterministic
+	if (checkpoints.empty() || checkpoints.back().steps < steps)
+	{
+		Checkpoint checkpoint{ steps, check_index };
+		for (size_t index = 0; index < vms.size(); ++index)
+			checkpoint.devices.push_back(vms[index]->Checkpoint());
+		checkpoints.push_back(move(checkpoint));
+
+		// thin out to every other checkpoint, always keeping the first one
+		if (checkpoints.size() > max<size_t>(history->max_checkpoints, 2))
+		{
+			checkpoint_interval *= 2;
+			checkpoints.erase(remove_if(checkpoints.begin() + 1, checkpoints.end(),
+				[&](auto&& checkpoint) { return checkpoint.steps % checkpoint_interval != 0; }), checkpoints.end());
+		}
+	}
+
+	// the undo log only covers the ticks since the last checkpoint
+	for (auto& vm : vms)
+		vm->ClearUndo();
+	undo_check_indices.clear();
+}
+
+inline void PuzzleInstance::RestoreCheckpoint(const Checkpoint& checkpoint)
+{
+	for (size_t index = 0; index < vms.size(); ++index)
+		vms[index]->Restore(checkpoint.devices[index]);
+	steps = checkpoint.steps;
+	check_index = checkpoint.check_index;
+	undo_check_indices.clear();
+	WatchCurrentCheck();
+	stalled = false;
+}
+
+inline void PuzzleInstance::UndoTick()
+{
+	for (auto& vm : vms)
+		vm->UndoTick();
+	if (check_index != undo_check_indices.back())
+	{
+		check_index = undo_check_indices.back();
+		WatchCurrentCheck();
+	}
+	undo_check_indices.pop_back();
+	--steps;
+	stalled = false;
+}
+
+inline void PuzzleInstance::ClearHistory()
+{
+	checkpoints.clear();
+	undo_check_indices.clear();
+	for (auto& vm : vms)
+		vm->ClearUndo();
+}
+
+inline void PuzzleInstance::RestartHistory()
+{
+	stalled = false;
+	ClearHistory();
+	if (history && State() != PuzzleState::Edit)
+		TakeCheckpoint();
+}
+
+inline bool PuzzleInstance::JumpTo(size_t step)
+{
+	if (State() == PuzzleState::Edit || !history || step < HistoryStart())
+		return false;
+
+	// undo back to a step since the last checkpoint, otherwise tick forwards from the last checkpoint before it
+	if (step < steps)
+	{
+		if (steps - step <= undo_check_indices.size())
+			while (steps > step)
+				UndoTick();
+		else
+			RestoreCheckpoint(*prev(ranges::upper_bound(checkpoints, step, {}, &Checkpoint::steps)));
+	}
+
+	while (steps < step)
+		Tick();
+
+	state = PuzzleState::Paused;
+	return true;
+}
+
+inline bool PuzzleInstance::Tick()
+{
+	if (history)
+	{
+		undo_check_indices.push_back(check_index);
+		for (auto& vm : vms)
+			vm->BeginUndoTick();
+	}
+
+	// compute: every active device steps against the messages delivered before this tick and queues what it sends, but
+	// the parked ones until something reached them; the order doesn't matter, none sees another's changes before the commit
+	for (size_t index = 0; index < parked_devices.size(); )
+		if (auto& parked = parked_devices[index]; parked.device->Activity() != parked.activity)
+		{
+			parked.device->Resume(steps - parked.since_step);
+			ready_devices.push_back(parked.device);
+			parked = parked_devices.back();
+			parked_devices.pop_back();
+		}
+		else
+			++index;
+
+	if (device_thread_pool)
+		device_thread_pool->ParallelFor(ready_devices.size(), [this](size_t index) { ready_devices[index]->Step(); });
+	else
+		for (auto device : ready_devices)
+			device->Step();
+
+	if (parking)
+		for (size_t index = 0; index < ready_devices.size(); )
+			if (auto device = ready_devices[index]; device->Parked())
+			{
+				parked_devices.push_back({ device, steps, device->Activity() });
+				ready_devices[index] = ready_devices.back();
+				ready_devices.pop_back();
+			}
+			else
+				++index;
+
+	// commit: no device changed another one while stepping, the messages change hands here
+	for (auto& vm : vms)
+		vm->CommitConsumedData();
+	for (auto& vm : vms)
+		vm->CommitOutgoingData();
+
+	// then the memories handle what they just received, one after the other in device order; those without messages
+	// have nothing to do
+	for (auto device : passive_devices)
+		if (device->HasIncomingData())
+		{
+			device->Step();
+			device->CommitConsumedData();
+			device->CommitOutgoingData();
+		}
+	++steps;
+
+	if (history)
+		for (auto& vm : vms)
+			vm->EndUndoTick();
+
+	const auto passed = CheckTick();
+	if (history && steps % checkpoint_interval == 0)
+		TakeCheckpoint();
+	return passed;
+}
+
+inline bool PuzzleInstance::CheckTick()
+{
+	const auto passed = RunChecks();
+	// a check is only looked at again once its memory changed, which nothing does anymore once every device loops
+	stalled = detect_loops && !passed && !check_dirty && !puzzle.checks[check_index].watches.empty()
+		&& ranges::all_of(active_devices, &BaseMemory::LoopLength) && ranges::none_of(passive_devices, &BaseMemory::HasIncomingData);
+	return passed;
+}
+
+inline size_t PuzzleInstance::TickAlone(size_t max_ticks)
+{
+	// every tick it goes through would only step it: no message on its way to a memory, no parked device to wake up, and
+	// a check that only looks at watched bytes, which it stops right after writing
+	if (history || ready_devices.size() != 1 || check_index == puzzle.checks.size() || check_dirty || puzzle.checks[check_index].watches.empty()
+		|| ranges::any_of(passive_devices, &BaseMemory::HasIncomingData)
+		|| ranges::any_of(parked_devices, [](auto&& parked) { return parked.device->Activity() != parked.activity; }))
+		return 0;
+
+	const auto ticks = ready_devices.front()->StepAlone(max_ticks);
+	steps += ticks;
+	return ticks;
 }
 
 inline void PuzzleInstance::Run()
@@ -166,50 +529,76 @@ inline void PuzzleInstance::Run()
 		SetupForRun();
 
 	state = PuzzleState::Running;
-	timer = SDL_AddTimerNS(250ULL * 100000, [](auto userdata, auto id, auto interval) -> uint64_t
-		{
-			auto&& self = reinterpret_cast<PuzzleInstance*>(userdata);
-			for (auto& vm : self->vms)
-				vm->Step();
-			return interval;
-		}, this);
-	assert(timer);
 }
 
-inline void PuzzleInstance::Step()
+inline bool PuzzleInstance::Step()
 {
 	if (State() == PuzzleState::Edit)
 		SetupForRun();
 
 	state = PuzzleState::Paused;
-	if (timer)
-	{
-		SDL_RemoveTimer(timer);
-		timer = 0;
-	}
-
-	for (auto& vm : vms)
-		vm->Step();
+	return Tick();
 }
 
 inline void PuzzleInstance::Pause()
 {
+	ResumeParkedDevices();
 	state = PuzzleState::Paused;
-	if (timer)
+}
+
+inline void PuzzleInstance::ResumeParkedDevices()
+{
+	for (auto& parked : parked_devices)
 	{
-		SDL_RemoveTimer(timer);
-		timer = 0;
+		parked.device->Resume(steps - parked.since_step);
+		ready_devices.push_back(parked.device);
 	}
+	parked_devices.clear();
+}
+
+inline string PuzzleInstance::StallDiagnostic() const
+{
+	string diagnostic = format("stalled at step {}, no device can change anymore:", steps);
+	for (auto device : active_devices)
+		diagnostic += format("{} {}/{} {} loops every {} step{}", device == active_devices.front() ? "" : ",", device->NetworkIndex(),
+			device->IndexInNetwork(), device->Name(), device->LoopLength(), device->LoopLength() == 1 ? "" : "s");
+	return diagnostic;
 }
 
 inline void PuzzleInstance::Stop()
 {
 	state = PuzzleState::Edit;
-	if (timer)
-	{
-		SDL_RemoveTimer(timer);
-		timer = 0;
-	}
 	for (auto& vm : vms)
 		vm->Stop();
+	ClearHistory();
+}
+
+inline PuzzleRunResult PuzzleInstance::RunToCompletion(size_t max_steps)
+{
+	PuzzleRunResult result;
+
+	const auto start = chrono::steady_clock::now();
+	SetupForRun();
+	state = PuzzleState::Running;
+	while (!result.passed && !stalled && steps < max_steps)
+		result.passed = TickAlone(max_steps - steps) ? CheckTick() : Tick();
+	if (stalled)
+		result.stall = StallDiagnostic();
+	ResumeParkedDevices();
+	state = PuzzleState::Paused;
+	result.wall_time = chrono::steady_clock::now() - start;
+	result.steps = steps;
+
+	for (auto& vm : vms)
+	{
+		if (!vm->ErrorMessage().empty())
+			result.errors.push_back(format("{}/{} {}: {}", vm->NetworkIndex(), vm->IndexInNetwork(), vm->Name(), vm->ErrorMessage()));
+
+		const auto& traffic = vm->Traffic();
+		result.traffic.messages_sent += traffic.messages_sent;
+		result.traffic.failed_sends += traffic.failed_sends;
+		result.traffic.peak_queue_occupancy = max(result.traffic.peak_queue_occupancy, traffic.peak_queue_occupancy);
+	}
+
+	return result;
 }
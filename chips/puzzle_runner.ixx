@@ -0,0 +1,251 @@
+module;
+
+#include "stdafx.h"
+
+export module puzzle_runner;
+
+import std.core;
+import std.threading;
+import puzzle;
+
+using namespace std;
+
+export enum class RunSpeed
+{
+	Slow,
+	Normal,
+	Fast,
+	Faster,
+	Unthrottled,
+};
+
+// timed speeds run a batch of ticks every interval, the unthrottled one ticks as fast as it can
+struct RunSpeedSetting
+{
+	const char* name;
+	chrono::nanoseconds interval;
+	size_t ticks;
+};
+
+constexpr array<RunSpeedSetting, 5> RunSpeedSettings
+{ {
+	{ "Slow", 250ms, 1 },
+	{ "Normal", 25ms, 1 },
+	{ "x10", 25ms, 10 },
+	{ "x1000", 25ms, 1000 },
+	{ "Max", 0ms, 0 },
+} };
+
+export vector<string> RunSpeedNames()
+{
+	return RunSpeedSettings | ranges::views::transform([](auto&& setting) { return string(setting.name); }) | ranges::to<vector<string>>();
+}
+
+// drives a PuzzleInstance for the interactive UI at the selected speed, and forwards its changes to the global event queue;
+// changes are published once per batch of ticks, the UI draws whatever was published last at its own frame rate.
+// the driver ticks on a worker thread, so the UI only touches the puzzle inside a ReadLock, which waits for the batch
+// being ticked and holds the next one back until it is released
+export class PuzzleRunner
+{
+	// the unthrottled driver publishes about once per frame, checking the clock every batch of ticks
+	static constexpr auto UnthrottledPublishInterval = 16ms;
+	static constexpr size_t UnthrottledBatchTicks = 1024;
+
+	shared_ptr<PuzzleInstance> puzzle;
+	RunSpeed speed = RunSpeed::Normal;
+	jthread driver;
+
+	// the driver ticks holding state_mutex; between batches it waits on state_changed until the UI isn't reading.
+	// a UI wanting to read bumps pending_reads first, so the unthrottled driver cuts its batches short for it
+	mutex state_mutex;
+	condition_variable_any state_changed;
+	bool reading = false;
+	atomic<size_t> pending_reads;
+
+	const RunSpeedSetting& Setting() const { return RunSpeedSettings[static_cast<size_t>(speed)]; }
+
+	// the driver gets its own copy of the setting, the UI only changes the speed once it is stopped
+	void StartDriver()
+	{
+		driver = jthread([this, setting = Setting()](stop_token stop) { Drive(stop, setting); });
+	}
+
+	// waits for the batch in flight, if any; a UI holding a ReadLock doesn't block this, the driver is then between batches
+	void StopDriver()
+	{
+		if (driver.joinable())
+		{
+			driver.request_stop();
+			driver.join();
+		}
+	}
+
+	void Drive(stop_token stop, const RunSpeedSetting setting)
+	{
+		unique_lock lock(state_mutex);
+		auto next_batch_time = chrono::steady_clock::now();
+		while (true)
+		{
+			// a stop request only ends the waits early, their predicates still decide what they return
+			if (setting.ticks)
+			{
+				next_batch_time += setting.interval;
+				state_changed.wait_until(lock, stop, next_batch_time, [] { return false; });
+				if (stop.stop_requested())
+					return;
+			}
+			state_changed.wait(lock, stop, [this] { return !reading && !pending_reads; });
+			if (stop.stop_requested())
+				return;
+
+			bool finished;
+			if (setting.ticks)
+				finished = TickBatch(setting.ticks);
+			else
+			{
+				const auto publish_time = chrono::steady_clock::now() + UnthrottledPublishInterval;
+				do
+					finished = TickBatch(UnthrottledBatchTicks);
+				while (!finished && !pending_reads && !stop.stop_requested() && chrono::steady_clock::now() < publish_time);
+			}
+			PublishChanges();
+			if (stop.stop_requested())
+				return;
+
+			if (finished)
+			{
+				Finished();
+				return;
+			}
+		}
+	}
+
+	// stops at the tick the checks passed on, or the one the run stalled on
+	bool TickBatch(size_t ticks)
+	{
+		for (size_t i = 0; i < ticks; ++i)
+			if (puzzle->Tick() || puzzle->Stalled())
+				return true;
+		return false;
+	}
+
+	// every fresh run gets new random puzzle inputs
+	void NewSeedIfEditing()
+	{
+		if (puzzle->State() == PuzzleState::Edit)
+			puzzle->Seed(random_device{}());
+	}
+
+	void Succeeded()
+	{
+		puzzle->Pause();
+		GlobalEventQueue.enqueue(GlobalEventType::PuzzleSuccess, puzzle.get());
+	}
+
+	// a stalled run would only go around the same loops until stopped, so it pauses there for the player to look at
+	void Finished()
+	{
+		if (puzzle->Stalled())
+		{
+			puzzle->Pause();
+			GlobalEventQueue.enqueue(GlobalEventType::PuzzleStalled, puzzle.get());
+		}
+		else
+			Succeeded();
+	}
+
+public:
+	PuzzleRunner(shared_ptr<PuzzleInstance> puzzle)
+		: puzzle(move(puzzle))
+	{
+	}
+
+	~PuzzleRunner() { StopDriver(); }
+
+	// while alive, the driver is between two batches and the puzzle can be read and edited from the UI thread
+	class ReadLock
+	{
+		shared_ptr<PuzzleRunner> runner;
+
+	public:
+		ReadLock(shared_ptr<PuzzleRunner> runner)
+			: runner(move(runner))
+		{
+			++this->runner->pending_reads;
+			lock_guard lock(this->runner->state_mutex);
+			this->runner->reading = true;
+			--this->runner->pending_reads;
+		}
+
+		~ReadLock()
+		{
+			{
+				lock_guard lock(runner->state_mutex);
+				runner->reading = false;
+			}
+			runner->state_changed.notify_all();
+		}
+
+		ReadLock(const ReadLock&) = delete;
+		ReadLock& operator=(const ReadLock&) = delete;
+	};
+
+	// sends one VMDirty notification per device that changed since the last call
+	void PublishChanges()
+	{
+		for (auto& vm : puzzle->VMs())
+			if (vm->PublishChanges())
+				GlobalEventQueue.enqueue(GlobalEventType::VMDirty, vm.get());
+	}
+
+	auto Speed() const { return speed; }
+	void Speed(RunSpeed value)
+	{
+		if (value == speed)
+			return;
+
+		// a running puzzle carries on at the new speed
+		StopDriver();
+		speed = value;
+		if (puzzle->State() == PuzzleState::Running)
+			StartDriver();
+	}
+
+	void Run()
+	{
+		StopDriver();
+		NewSeedIfEditing();
+		puzzle->Run();
+		StartDriver();
+	}
+
+	void Step()
+	{
+		StopDriver();
+		NewSeedIfEditing();
+		const auto passed = puzzle->Step();
+		PublishChanges();
+		if (passed)
+			Succeeded();
+	}
+
+	void StepBack()
+	{
+		StopDriver();
+		puzzle->StepBack();
+		PublishChanges();
+	}
+
+	void Pause()
+	{
+		StopDriver();
+		puzzle->Pause();
+	}
+
+	void Stop()
+	{
+		StopDriver();
+		puzzle->Stop();
+		PublishChanges();
+	}
+};
@@ -0,0 +1,171 @@
+module;
+
+#include "stdafx.h"
+
+export module puzzle_validation;
+
+import std;
+import puzzle;
+import thread_pool;
+
+using namespace std;
+
+export struct PuzzleSeedResult
+{
+	uint64_t seed{};
+	PuzzleRunResult run;
+};
+
+// how one measure spread over the seeds of a validation
+export struct PuzzleStatistic
+{
+	double min{}, median{}, average{}, p90{}, max{};
+
+	static PuzzleStatistic Of(vector<double> values)
+	{
+		if (values.empty())
+			return {};
+		ranges::sort(values);
+		const auto percentile = [&](double fraction) { return values[static_cast<size_t>(fraction * (values.size() - 1) + 0.5)]; };
+		return { values.front(), percentile(0.5), accumulate(values.begin(), values.end(), 0.0) / values.size(), percentile(0.9), values.back() };
+	}
+};
+
+// what a solution costs, all of it the lower the better; solutions that pass every seed rank by the average steps,
+// then the program size, the messages sent, the failed sends and the peak queue occupancy
+export struct PuzzleScore
+{
+	size_t program_size{};
+	PuzzleStatistic steps, messages_sent, failed_sends, peak_queue_occupancy;
+
+	auto RankingKey() const
+	{
+		return tuple{ steps.average, program_size, messages_sent.average, failed_sends.average, peak_queue_occupancy.max };
+	}
+};
+
+export struct PuzzleValidationResult
+{
+	vector<PuzzleSeedResult> seed_results;
+	vector<uint64_t> failing_seeds;
+	double pass_rate{};
+	size_t min_steps{};
+	double average_steps{};
+	size_t max_steps{};
+	chrono::nanoseconds wall_time{};
+	PuzzleScore score;
+
+	bool Passed() const { return !seed_results.empty() && failing_seeds.empty(); }
+};
+
+// loads the solution into a freshly made instance before it runs
+export using TPreparePuzzleInstance = function<void(PuzzleInstance& puzzle_instance)>;
+
+// copies the programs of solution's editable devices as they are now, it has to outlive the validation
+export TPreparePuzzleInstance CopySolution(PuzzleInstance& solution)
+{
+	return [&solution](PuzzleInstance& puzzle_instance)
+		{
+			for (size_t index = 0; index < solution.VMs().size(); ++index)
+				if (auto source = solution.VM(index); source->Editable())
+				{
+					auto destination = puzzle_instance.VM(index);
+					for (size_t address = 0; address < source->MemorySize(); ++address)
+						if (const auto value = source->Memory(address); value || destination->Memory(address))
+							destination->Memory(address, value);
+				}
+		};
+}
+
+// runs the solution once per seed in [first_seed, first_seed + seed_count), every run on its own instance,
+// spread over thread_count threads; results are ordered by seed so they don't depend on the scheduling.
+// validated_seeds, if any, counts the seeds done as they finish; once stop is requested the seeds not started yet
+// are skipped, leaving the result incomplete
+export PuzzleValidationResult ValidatePuzzle(Puzzle& puzzle, const TPreparePuzzleInstance& prepare,
+	uint64_t first_seed, size_t seed_count, size_t max_steps, size_t thread_count,
+	atomic<size_t>* validated_seeds = nullptr, stop_token stop = {})
+{
+	PuzzleValidationResult result;
+	result.seed_results.resize(seed_count);
+
+	const auto start = chrono::steady_clock::now();
+	ThreadPool pool(max<size_t>(1, min(thread_count, seed_count)));
+	pool.ParallelFor(seed_count, [&](size_t index)
+		{
+			if (stop.stop_requested())
+				return;
+
+			auto puzzle_instance = puzzle.make();
+			prepare(*puzzle_instance);
+			if (index == 0)
+				result.score.program_size = puzzle_instance->ProgramSize();
+
+			auto& seed_result = result.seed_results[index];
+			seed_result.seed = first_seed + index;
+			puzzle_instance->Seed(seed_result.seed);
+			seed_result.run = puzzle_instance->RunToCompletion(max_steps);
+			if (validated_seeds)
+				++*validated_seeds;
+		});
+	result.wall_time = chrono::steady_clock::now() - start;
+
+	if (seed_count == 0)
+		return result;
+
+	size_t total_steps = 0;
+	result.min_steps = numeric_limits<size_t>::max();
+	for (auto& seed_result : result.seed_results)
+	{
+		if (!seed_result.run.passed)
+			result.failing_seeds.push_back(seed_result.seed);
+		result.min_steps = min(result.min_steps, seed_result.run.steps);
+		result.max_steps = max(result.max_steps, seed_result.run.steps);
+		total_steps += seed_result.run.steps;
+	}
+	result.pass_rate = static_cast<double>(seed_count - result.failing_seeds.size()) / seed_count;
+	result.average_steps = static_cast<double>(total_steps) / seed_count;
+
+	const auto statistic = [&](auto&& measure)
+		{
+			return PuzzleStatistic::Of(result.seed_results
+				| views::transform([&](auto&& seed_result) { return static_cast<double>(measure(seed_result.run)); })
+				| ranges::to<vector<double>>());
+		};
+	result.score.steps = statistic([](auto&& run) { return run.steps; });
+	result.score.messages_sent = statistic([](auto&& run) { return run.traffic.messages_sent; });
+	result.score.failed_sends = statistic([](auto&& run) { return run.traffic.failed_sends; });
+	result.score.peak_queue_occupancy = statistic([](auto&& run) { return run.traffic.peak_queue_occupancy; });
+
+	return result;
+}
+
+// the validation as a JSON object: the score, then every seed's own numbers
+export string ValidationJson(const Puzzle& puzzle, const PuzzleValidationResult& result)
+{
+	const auto statistic_json = [](const PuzzleStatistic& statistic)
+		{
+			return format("{{ \"min\": {}, \"median\": {}, \"average\": {:.3f}, \"p90\": {}, \"max\": {} }}",
+				statistic.min, statistic.median, statistic.average, statistic.p90, statistic.max);
+		};
+
+	string puzzle_name;
+	for (auto c : puzzle.name)
+		if (c == '"' || c == '\\')
+			puzzle_name += { '\\', c };
+		else if (static_cast<unsigned char>(c) >= 0x20)
+			puzzle_name += c;
+
+	auto& score = result.score;
+	string json = format("{{\n\t\"puzzle\": \"{}\",\n\t\"passed\": {},\n\t\"pass_rate\": {:.4f},\n\t\"program_size\": {},\n"
+		"\t\"steps\": {},\n\t\"messages_sent\": {},\n\t\"failed_sends\": {},\n\t\"peak_queue_occupancy\": {},\n\t\"seeds\": [",
+		puzzle_name, result.Passed(), result.pass_rate, score.program_size, statistic_json(score.steps), statistic_json(score.messages_sent),
+		statistic_json(score.failed_sends), statistic_json(score.peak_queue_occupancy));
+	for (size_t index = 0; index < result.seed_results.size(); ++index)
+	{
+		auto& [seed, run] = result.seed_results[index];
+		json += format("{}\n\t\t{{ \"seed\": {}, \"passed\": {}, \"steps\": {}, \"messages_sent\": {}, \"failed_sends\": {}, \"peak_queue_occupancy\": {}, \"stalled\": {} }}",
+			index ? "," : "", seed, run.passed, run.steps, run.traffic.messages_sent, run.traffic.failed_sends, run.traffic.peak_queue_occupancy,
+			!run.stall.empty());
+	}
+	return json + "\n\t]\n}\n";
+}
@@ -4,14 +4,12 @@ module;
 
 export module puzzles;
 
-import std.core;
+import std;
 import puzzle;
+import vm;
 import vm_machines;
 
 using namespace std;
-using namespace ftxui;
-
-static default_random_engine random_engine;
 
 export array Puzzles
 {
@@ -21,8 +19,11 @@ export array Puzzles
 		"Load `0xDE` at `0x10` and `0xAD` at `0x11` in memory.\n",
 		[](auto& puzzle_instance) {},
 		{
-			[](auto& puzzle_instance) {
-				return puzzle_instance.VM(0)->Memory(0x10) == 0xDE && puzzle_instance.VM(0)->Memory(0x11) == 0xAD;
+			{
+				[](auto& puzzle_instance) {
+					return puzzle_instance.VM(0)->Memory(0x10) == 0xDE && puzzle_instance.VM(0)->Memory(0x11) == 0xAD;
+				},
+				{ { 0, 0x10, 0x12 } }
 			}
 		}
 	},
@@ -38,24 +39,25 @@ export array Puzzles
 		[](auto& puzzle_instance) {
 			auto rom = puzzle_instance.VM(1);
 
-			uniform_int_distribution<uint16_t> dist_size(12, static_cast<uint16_t>(32));
-			auto data_length = static_cast<TMemory>(dist_size(random_engine));
+			auto data_length = static_cast<TMemory>(puzzle_instance.Random(12, 32));
 			rom->Memory(0, data_length);
 
-			uniform_int_distribution<uint16_t> dist_byte(0, 255);
 			for (size_t i = 0; i < data_length; ++i)
-				rom->Memory(1 + i, static_cast<TMemory>(dist_byte(random_engine)));
+				rom->Memory(1 + i, static_cast<TMemory>(puzzle_instance.Random(0, 255)));
 		},
 		{
-			[](auto& puzzle_instance) {
-				auto cpu = puzzle_instance.VM(0);
-				auto rom = puzzle_instance.VM(1);
+			{
+				[](auto& puzzle_instance) {
+					auto cpu = puzzle_instance.VM(0);
+					auto rom = puzzle_instance.VM(1);
 
-				auto data_length = rom->Memory(0);
-				uint8_t sum = 0;
-				for (size_t i = 0; i < data_length; ++i)
-					sum += rom->Memory(1 + i);
-				return cpu->Memory(0x70) == sum;
+					auto data_length = rom->Memory(0);
+					uint8_t sum = 0;
+					for (size_t i = 0; i < data_length; ++i)
+						sum += rom->Memory(1 + i);
+					return cpu->Memory(0x70) == sum;
+				},
+				{ { 0, 0x70, 0x71 }, { 1, 0, 0x21 } }
 			}
 		}
 	},
@@ -74,7 +76,7 @@ export array Puzzles
 		[](auto&) {},
 		ranges::views::iota(0, 16) 
 			| ranges::views::transform([](auto i) {
-				return [i](auto& puzzle_instance) {
+				return Puzzle::TCheck { [i](auto& puzzle_instance) {
 					const auto&& display = puzzle_instance.VM(1);
 				
 					int x0, y0;
@@ -99,21 +101,50 @@ export array Puzzles
 						for (auto x = 0; x < 4; ++x)
 						{
 							const auto ch = display->Memory(y * 4 * 3 + x * 3);
-							const auto fg = (Color::Palette256)display->Memory(y * 4 * 3 + x * 3 + 1);
-							const auto bg = (Color::Palette256)display->Memory(y * 4 * 3 + x * 3 + 2);
+							const auto fg = static_cast<DisplayColor>(display->Memory(y * 4 * 3 + x * 3 + 1));
+							const auto bg = static_cast<DisplayColor>(display->Memory(y * 4 * 3 + x * 3 + 2));
 
 							if (x == x0 && y == y0)
 							{
-								if (bg != Color::Palette16::Blue || ch != 0)
+								if (bg != DisplayColor::Blue || ch != 0)
 									return false;
 							}
-							else if (bg != Color::Palette16::Black || ch != 0)
+							else if (bg != DisplayColor::Black || ch != 0)
 								return false;
 						}
 
 					return true;
-				};
+				}, { { 1, 0, 4 * 4 * 3 } } };
 			}) 
 			| ranges::to<vector<Puzzle::TCheck>>()
 	},
+	Puzzle {
+		// 02 01 10 70 0b 08 0a 02 02 01 10 78 0b 10 0a 0a
+		// 00 7e 07 7e 04 7e 06 a0 04 7c 00 7e 0f 30 0b 08
+		// 0a 20
+		// @60 00 0f 01
+		// @70 00 60 00 02 a0 05 03 00 02 a0 05 02 a3 05 03 00
+		{
+			{
+				{ "CPU", MakeTest02Machine, true, {} },
+				{ "DMA", MakeDMAMachine, false, {} },
+				{ "Display", MakeDisplay32x16Machine, false, {} },
+			}
+		},
+		"Large Display Test",
+		"Paint the bottom row of the `32x16` display red.\nIts cells are past the `256` bytes `OUTI8` can address,\nhave the DMA copy them with `XFER` instead.",
+		[](auto&) {},
+		{
+			{
+				[](auto& puzzle_instance) {
+					const auto&& display = puzzle_instance.VM(2);
+					for (size_t x = 0; x < 32; ++x)
+						if (static_cast<DisplayColor>(display->Memory(15 * 32 * 3 + x * 3 + 2)) != DisplayColor::Red)
+							return false;
+					return true;
+				},
+				{ { 2, 15 * 32 * 3, 16 * 32 * 3 } }
+			}
+		}
+	},
 };
\ No newline at end of file
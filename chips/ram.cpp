@@ -1,6 +1,6 @@
 #include "stdafx.h"
 
-import std.core;
+import std;
 import vm;
 
 using namespace std;
@@ -12,23 +12,21 @@ void RAM::Step()
 
 bool RAM::ExecuteNextInstruction()
 {
-	// memories only respond to IN and OUT instructions
-	for (auto& [index, data] : incoming_data)
-		if (data)
-			if (get<1>(*data))
+	// memories only respond to IN and OUT instructions, one message per sender and tick
+	for (auto& [index, queue] : incoming_data)
+		if (!queue.Empty())
+			if (auto& data = queue.Front(); get<1>(data))
 			{
 				// write operation
-				if (!Memory(get<0>(*data), *get<1>(*data)))
+				if (!Memory(get<0>(data), *get<1>(data)))
 					return false;
-				incoming_data[index] = nullopt;
+				ConsumeIncomingData(index);
 			}
 			else
 			{
-				// read operation
-				auto src_vm = NetworkVM(index);
-				if (src_vm)
-					(*src_vm)->IncomingData(IndexInNetwork(), { { get<0>(*data), Memory(get<0>(*data)) } });
-				incoming_data[index] = nullopt;
+				// read operation, held back until the reply fits in the requester's queue
+				if (SendData(index, { get<0>(data), Memory(get<0>(data)) }))
+					ConsumeIncomingData(index);
 			}
 
 	return true;
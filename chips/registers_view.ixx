@@ -35,7 +35,7 @@ public:
 			text("F:  ") | bold | dim
 			}));
 		elements.push_back(vbox({
-			text(format("{:#04x}", vm->IP())),
+			text(format("{:#0{}x}", vm->IP(), 2 + vm->AddressBytes() * 2)),
 			hbox({
 				vm->FlagZero() ? text("Z") | color(Color::LightGreen) : text("Z") | dim,
 				}),
@@ -1,18 +1,32 @@
 #pragma once
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdexcept>
 
 template<class... Ts> struct overload : Ts... { using Ts::operator()...; };
 
-#include "ftxui/component/captured_mouse.hpp"  
-#include "ftxui/component/component.hpp"  
-#include "ftxui/component/component_base.hpp"      
-#include "ftxui/component/component_options.hpp"   
-#include "ftxui/component/screen_interactive.hpp"  
-#include "ftxui/dom/elements.hpp"  
-#include "ftxui/dom/canvas.hpp"  
-#include "ftxui/screen/color.hpp"  
-#include "ftxui/component/loop.hpp"      
+class not_implemented : public std::logic_error
+{
+public:
+	not_implemented() : std::logic_error("Function not yet implemented") {}
+};
+
+using TNetworkIndex = uint8_t;
+using TIndexInNetwork = uint8_t;
+
+// the headless build (vm, vm_machines, puzzle and puzzles) stops here, everything below is only used by the interactive UI
+#ifndef CHIPS_HEADLESS
+
+#include "ftxui/component/captured_mouse.hpp"
+#include "ftxui/component/component.hpp"
+#include "ftxui/component/component_base.hpp"
+#include "ftxui/component/component_options.hpp"
+#include "ftxui/component/screen_interactive.hpp"
+#include "ftxui/dom/elements.hpp"
+#include "ftxui/dom/canvas.hpp"
+#include "ftxui/screen/color.hpp"
+#include "ftxui/component/loop.hpp"
 #include "scroller.h"
 
 #include <SDL3/SDL.h>
@@ -26,23 +40,16 @@ void ResizeConsoleWindow(int width, int height);
 
 ftxui::Element BuildMarkupElement(const std::string& description_markup);
 
-class not_implemented : public std::logic_error
-{
-public:
-	not_implemented() : std::logic_error("Function not yet implemented") {}
-};
-
-using TNetworkIndex = uint8_t;
-using TIndexInNetwork = uint8_t;
-
 class BaseMemory;
 struct PuzzleInstance;
 enum class GlobalEventType
 {
 	VMDirty,
-	VMInstructionExecuted,
 	PuzzleSuccess,
+	PuzzleStalled,
 	LoadNewPuzzle,
 };
 using TGlobalEventSource = std::optional<std::variant<BaseMemory*, PuzzleInstance*>>;
-inline eventpp::EventQueue<GlobalEventType, void(TGlobalEventSource source)> GlobalEventQueue;
\ No newline at end of file
+inline eventpp::EventQueue<GlobalEventType, void(TGlobalEventSource source)> GlobalEventQueue;
+
+#endif
@@ -0,0 +1,136 @@
+#include "stdafx.h"
+
+import std;
+import vm;
+import puzzle;
+import puzzles;
+import superoptimizer;
+
+using namespace std;
+
+static void PrintUsage()
+{
+	println(stderr, "usage: chips-superopt <puzzle name or index> [--device N] [--size N] [--goal size|steps] [--candidates N]");
+	println(stderr, "                      [--imm LIST] [--addr LIST] [--seed N] [--seeds N] [--max-steps N] [--threads N]");
+	println(stderr, "                      [--output FILE]");
+	println(stderr, "       LIST is comma separated, like 0x10,0x11; the defaults come from the puzzle's devices and checks");
+}
+
+static optional<size_t> FindPuzzle(string_view name_or_index)
+{
+	for (size_t index = 0; index < Puzzles.size(); ++index)
+		if (Puzzles[index].name == name_or_index || to_string(index) == name_or_index)
+			return index;
+	return nullopt;
+}
+
+template<typename TValue>
+static vector<TValue> ParseList(const string& list)
+{
+	vector<TValue> values;
+	for (auto&& value : views::split(list, ','))
+		values.push_back(static_cast<TValue>(stoull(string(value.begin(), value.end()), nullptr, 0)));
+	return values;
+}
+
+int main(int argc, char** argv)
+{
+	const vector<string> args(argv + 1, argv + argc);
+	if (args.empty() || args[0].starts_with("--"))
+	{
+		PrintUsage();
+		return 2;
+	}
+
+	const auto puzzle_index = FindPuzzle(args[0]);
+	if (!puzzle_index)
+	{
+		println(stderr, "Unknown puzzle \"{}\".", args[0]);
+		return 2;
+	}
+	auto& puzzle = Puzzles[*puzzle_index];
+
+	// the first device the player can edit, unless another one is asked for
+	auto instance = puzzle.make();
+	optional<size_t> device_index;
+	for (size_t i = 1; i + 1 < args.size(); ++i)
+		if (args[i] == "--device")
+			device_index = stoull(args[i + 1]);
+	if (!device_index)
+		if (auto it = ranges::find_if(instance->VMs(), [](auto&& vm) { return vm->Editable(); }); it != instance->VMs().end())
+			device_index = distance(instance->VMs().begin(), it);
+	if (!device_index || *device_index >= instance->VMs().size() || !dynamic_pointer_cast<VM>(instance->VM(*device_index)))
+	{
+		println(stderr, "No programmable device to search a program for.");
+		return 2;
+	}
+
+	auto options = DefaultSuperoptimizerOptions(puzzle, *device_index);
+	string output_path;
+	for (size_t i = 1; i < args.size(); ++i)
+		if (args[i] == "--device" && i + 1 < args.size())
+			++i;
+		else if (args[i] == "--size" && i + 1 < args.size())
+			options.max_program_size = stoull(args[++i]);
+		else if (args[i] == "--goal" && i + 1 < args.size() && (args[i + 1] == "size" || args[i + 1] == "steps"))
+			options.goal = args[++i] == "size" ? SuperoptimizerGoal::Size : SuperoptimizerGoal::Steps;
+		else if (args[i] == "--candidates" && i + 1 < args.size())
+			options.candidate_count = max<size_t>(stoull(args[++i]), 1);
+		else if (args[i] == "--imm" && i + 1 < args.size())
+			options.immediates = ParseList<TMemory>(args[++i]);
+		else if (args[i] == "--addr" && i + 1 < args.size())
+			options.addresses = ParseList<size_t>(args[++i]);
+		else if (args[i] == "--seed" && i + 1 < args.size())
+			options.first_seed = stoull(args[++i]);
+		else if (args[i] == "--seeds" && i + 1 < args.size())
+			options.seed_count = max<size_t>(stoull(args[++i]), 1);
+		else if (args[i] == "--max-steps" && i + 1 < args.size())
+			options.max_steps = stoull(args[++i]);
+		else if (args[i] == "--threads" && i + 1 < args.size())
+			options.thread_count = max<size_t>(stoull(args[++i]), 1);
+		else if (args[i] == "--output" && i + 1 < args.size())
+			output_path = args[++i];
+		else
+		{
+			PrintUsage();
+			return 2;
+		}
+
+	println("searching {} bytes for {} with immediates {::#04x} and addresses {::#x}", options.max_program_size,
+		instance->VM(*device_index)->Name(), options.immediates, options.addresses);
+	const auto result = Superoptimize(puzzle, options);
+
+	println("heads: {} ({} merged)", result.heads, result.merged_heads);
+	println("programs: {} ({} pruned, {} run, {} rejected)", result.programs, result.pruned_programs, result.run_programs, result.rejected_programs);
+	println("wall time: {:.3f} s", chrono::duration<double>(result.wall_time).count());
+	if (result.candidates.empty())
+	{
+		println("no program passed");
+		return 1;
+	}
+
+	// disassembled on an instance of their own, the device's original program out of the way
+	auto device = instance->VM(*device_index);
+	for (size_t rank = 0; rank < result.candidates.size(); ++rank)
+	{
+		auto& candidate = result.candidates[rank];
+		for (size_t address = 0; address < device->MemorySize(); ++address)
+			device->Memory(address, address < candidate.program.size() ? candidate.program[address] : 0);
+
+		println("#{} {} bytes, steps avg {:.1f} / max {}", rank + 1, candidate.program.size(),
+			static_cast<double>(candidate.total_steps) / options.seed_count, candidate.max_steps);
+		for (auto address : candidate.instruction_addresses)
+			println("\t{:02X}: {}", address, device->DecodeInstruction(address).value_or("???"));
+	}
+
+	if (!output_path.empty())
+	{
+		auto& best = result.candidates.front().program;
+		if (ofstream file(output_path, ios::binary); !file.write(reinterpret_cast<const char*>(best.data()), best.size()))
+		{
+			println(stderr, "Cannot write the best program to \"{}\".", output_path);
+			return 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,525 @@
+module;
+
+#include "stdafx.h"
+
+export module superoptimizer;
+
+import std;
+import vm;
+import vm_instruction_set;
+import puzzle;
+import thread_pool;
+
+using namespace std;
+
+export enum class SuperoptimizerGoal
+{
+	// the fewest bytes, then the fewest steps
+	Size,
+	// the fewest steps over all seeds, then the fewest bytes
+	Steps,
+};
+
+export struct SuperoptimizerOptions
+{
+	// the device whose program is searched, the other devices keep theirs
+	size_t device{};
+	size_t max_program_size = 8;
+	SuperoptimizerGoal goal = SuperoptimizerGoal::Size;
+	// the values tried for immediate and address operands; jumps always try every instruction boundary from the end of
+	// the program's straight-line head on
+	vector<TMemory> immediates;
+	vector<size_t> addresses;
+	uint64_t first_seed{};
+	size_t seed_count = 8;
+	size_t max_steps = 2'000;
+	// how many of the best programs are kept
+	size_t candidate_count = 10;
+	size_t thread_count = max(thread::hardware_concurrency(), 1u);
+};
+
+export struct SuperoptimizerCandidate
+{
+	vector<TMemory> program;
+	// where each of its instructions starts
+	vector<size_t> instruction_addresses;
+	// over all seeds
+	uint64_t total_steps{};
+	size_t max_steps{};
+};
+
+export struct SuperoptimizerResult
+{
+	// best first
+	vector<SuperoptimizerCandidate> candidates;
+	// straight-line heads tried, and how many of them ended in the same state as a smaller or earlier one
+	uint64_t heads{}, merged_heads{};
+	// programs enumerated, those dropped for jumping between instructions or repeating another enumeration, those run
+	// and those that failed a seed
+	uint64_t programs{}, pruned_programs{}, run_programs{}, rejected_programs{};
+	chrono::nanoseconds wall_time{};
+};
+
+// the values a program for device usually needs: small constants, the indices of its network's devices and the bytes
+// the checks watch on it, which it reads and writes by address
+export SuperoptimizerOptions DefaultSuperoptimizerOptions(Puzzle& puzzle, size_t device)
+{
+	SuperoptimizerOptions options{ .device = device };
+	options.immediates = { 0, 1, 2, 0xFF };
+
+	auto instance = puzzle.make();
+	const auto network_index = instance->VM(device)->NetworkIndex();
+	for (auto& other : instance->VMs(network_index))
+		options.immediates.push_back(other->IndexInNetwork());
+
+	for (auto& check : puzzle.checks)
+		for (auto& watch : check.watches)
+			if (watch.device == device)
+				for (auto address = watch.begin; address < watch.end; ++address)
+					options.addresses.push_back(address);
+
+	ranges::sort(options.immediates);
+	options.immediates.erase(ranges::unique(options.immediates).begin(), options.immediates.end());
+	ranges::sort(options.addresses);
+	options.addresses.erase(ranges::unique(options.addresses).begin(), options.addresses.end());
+	return options;
+}
+
+// enumerates programs of growing size one instruction at a time, runs those that can still rank against the seeds, and
+// keeps the best. A program is a straight-line head of instructions that neither jump nor talk to the network, followed
+// by a tail that never jumps back into the head; heads of one size that leave the device in the same state are merged,
+// so only the first of them gets tails
+class Superoptimizer
+{
+	// an instruction with its operands, a jump's target being filled in per program
+	struct Choice
+	{
+		const VMInstruction* instruction;
+		vector<TMemory> bytes;
+		bool straight_line{};
+		bool jump{};
+		size_t target_offset{}, target_bytes{};
+	};
+
+	struct Head
+	{
+		vector<TMemory> program;
+		vector<size_t> instruction_addresses;
+	};
+
+	// a program being completed up to size bytes after its head
+	struct Partial
+	{
+		vector<TMemory> program;
+		vector<size_t> instruction_addresses;
+		vector<size_t> targets;
+		size_t head_size, size;
+		bool straight_line_tail{};
+	};
+
+	// an instance to run programs on, only used by one thread at a time
+	struct Worker
+	{
+		shared_ptr<PuzzleInstance> instance;
+		shared_ptr<VM> vm;
+		size_t loaded_size{};
+
+		void Load(span<const TMemory> program)
+		{
+			for (size_t address = 0; address < max(loaded_size, program.size()); ++address)
+				vm->Memory(address, address < program.size() ? program[address] : 0);
+			loaded_size = program.size();
+		}
+	};
+
+	Puzzle& puzzle;
+	const SuperoptimizerOptions& options;
+	// the options' size, unless the device is smaller
+	size_t max_program_size{};
+	vector<Choice> choices;
+	// heads by size, in the order they were found
+	vector<vector<Head>> heads;
+	// whether the setup leaves the device as it was, heads can't be merged otherwise
+	bool mergeable_heads = true;
+
+	ThreadPool pool;
+	mutex workers_mutex;
+	vector<unique_ptr<Worker>> idle_workers;
+
+	mutex candidates_mutex;
+	vector<SuperoptimizerCandidate> candidates;
+	// for the steps goal, the most total steps a program can take and still rank
+	atomic<uint64_t> step_bound = numeric_limits<uint64_t>::max();
+
+	atomic<uint64_t> program_count{}, pruned_program_count{}, run_program_count{}, rejected_program_count{};
+
+	static bool IsJump(const VMInstruction& instruction)
+	{
+		return instruction.semantics == &JmpImm8::Execute || instruction.semantics == &JmpNotZeroImm8::Execute
+			|| instruction.semantics == &JmpAddress::Execute || instruction.semantics == &JmpNotZeroAddress::Execute;
+	}
+
+	static void WriteLittleEndian(TMemory* destination, size_t value, size_t bytes)
+	{
+		for (size_t index = 0; index < bytes; ++index)
+			destination[index] = static_cast<TMemory>(value >> (index * 8));
+	}
+
+	bool Better(const SuperoptimizerCandidate& left, const SuperoptimizerCandidate& right) const
+	{
+		const auto key = [this](const SuperoptimizerCandidate& candidate)
+			{
+				const uint64_t size = candidate.program.size();
+				return options.goal == SuperoptimizerGoal::Size ? pair{ size, candidate.total_steps } : pair{ candidate.total_steps, size };
+			};
+		if (key(left) != key(right))
+			return key(left) < key(right);
+		return left.program < right.program;
+	}
+
+	unique_ptr<Worker> MakeWorker()
+	{
+		auto worker = make_unique<Worker>();
+		worker->instance = puzzle.make();
+		worker->vm = dynamic_pointer_cast<VM>(worker->instance->VM(options.device));
+		for (auto& device : worker->instance->VMs())
+			if (auto vm = dynamic_pointer_cast<VM>(device))
+				vm->ExecutionTier(VMExecutionTier::Compiled);
+
+		// the searched program starts from an empty memory instead of the puzzle's example
+		for (size_t address = 0; address < worker->vm->MemorySize(); ++address)
+			if (worker->vm->Memory(address))
+				worker->vm->Memory(address, 0);
+		return worker;
+	}
+
+	// runs body with a worker of its own, so the threads of the pool share them without knowing their index
+	template<typename TBody>
+	void WithWorker(TBody&& body)
+	{
+		unique_ptr<Worker> worker;
+		{
+			lock_guard lock(workers_mutex);
+			if (!idle_workers.empty())
+			{
+				worker = move(idle_workers.back());
+				idle_workers.pop_back();
+			}
+		}
+		if (!worker)
+			worker = MakeWorker();
+
+		body(*worker);
+
+		lock_guard lock(workers_mutex);
+		idle_workers.push_back(move(worker));
+	}
+
+	// every combination of the options' values for the operands from operand_index on
+	void AddOperands(const VM& vm, Choice& partial, size_t operand_index)
+	{
+		auto& instruction = *partial.instruction;
+		if (operand_index == instruction.operands.size())
+		{
+			choices.push_back(partial);
+			return;
+		}
+
+		vector<size_t> values;
+		size_t bytes = 1;
+		visit(overload{
+			[&](const Imm<1>&) { values.assign(options.immediates.begin(), options.immediates.end()); },
+			[&](const Imm<2>&) { values.assign(options.immediates.begin(), options.immediates.end()); bytes = 2; },
+			[&](const Imm<4>&) { values.assign(options.immediates.begin(), options.immediates.end()); bytes = 4; },
+			[&](const Addr&) {
+				ranges::copy_if(options.addresses, back_inserter(values), [&](size_t address) { return address < vm.MemorySize(); });
+				bytes = instruction.address_bytes;
+			},
+			[&](const Reg&) { for (size_t index = 0; index < vm.RegisterCount(); ++index) values.push_back(index); },
+			}, instruction.operands[operand_index]);
+
+		for (auto value : values)
+		{
+			const auto offset = partial.bytes.size();
+			partial.bytes.resize(offset + bytes);
+			WriteLittleEndian(&partial.bytes[offset], value, bytes);
+			AddOperands(vm, partial, operand_index + 1);
+			partial.bytes.resize(offset);
+		}
+	}
+
+	void MakeChoices(const VM& vm)
+	{
+		for (auto& instruction : vm.Instructions())
+		{
+			Choice choice{ &instruction, instruction.base_opcode, !instruction.ends_block, IsJump(instruction) };
+			if (choice.jump)
+			{
+				// the target is the first operand, whatever its width
+				choice.target_offset = choice.bytes.size();
+				choice.target_bytes = instruction.OpcodeLength() - choice.bytes.size();
+				choice.bytes.resize(instruction.OpcodeLength());
+				choices.push_back(move(choice));
+			}
+			else
+				AddOperands(vm, choice, 0);
+		}
+	}
+
+	// where the head leaves the device after running on its own: its registers and flag, and what it wrote or holds at
+	// every address operands can name; nothing for heads that read the bytes after them, which differ between programs
+	optional<string> HeadState(Worker& worker, const Head& head)
+	{
+		auto& instance = worker.instance;
+		auto& vm = worker.vm;
+		worker.Load(head.program);
+		vm->Profiling(true);
+		instance->Seed(options.first_seed);
+		instance->SetupForRun();
+		for (size_t step = 0; step < head.instruction_addresses.size(); ++step)
+			vm->Step();
+
+		optional<string> state;
+		const auto& profile = *vm->Profile();
+		bool read_after = false;
+		for (auto address = head.program.size(); address < max_program_size; ++address)
+			read_after |= profile.reads[address] > 0;
+		if (mergeable_heads && vm->ErrorMessage().empty() && !read_after)
+		{
+			state = format("{} {} {}", head.instruction_addresses.size(), vm->FlagZero(), vm->IP());
+			for (size_t index = 0; index < vm->RegisterCount(); ++index)
+				*state += format(" {}", vm->Register(static_cast<int>(index)));
+			for (auto address : options.addresses)
+				if (address < vm->MemorySize())
+					*state += address < head.program.size() || profile.writes[address] ? format(" {}", vm->Memory(address)) : " -";
+		}
+
+		instance->Stop();
+		vm->Profiling(false);
+		return state;
+	}
+
+	// the heads of every size, breadth first so the first head to reach a state is also the smallest one
+	void FindHeads(SuperoptimizerResult& result)
+	{
+		heads.assign(max_program_size + 1, {});
+		heads[0].push_back({});
+
+		for (size_t size = 1; size <= max_program_size; ++size)
+		{
+			vector<Head> extensions;
+			for (size_t head_size = 0; head_size < size; ++head_size)
+				for (auto& head : heads[head_size])
+					for (auto& choice : choices)
+						if (choice.straight_line && head_size + choice.bytes.size() == size)
+						{
+							auto extension = head;
+							extension.instruction_addresses.push_back(head_size);
+							extension.program.insert(extension.program.end(), choice.bytes.begin(), choice.bytes.end());
+							extensions.push_back(move(extension));
+						}
+
+			vector<optional<string>> states(extensions.size());
+			pool.ParallelFor(extensions.size(), [&](size_t index) { WithWorker([&](Worker& worker) { states[index] = HeadState(worker, extensions[index]); }); });
+
+			unordered_set<string> seen_states;
+			for (size_t index = 0; index < extensions.size(); ++index)
+				if (!states[index] || seen_states.insert(*states[index]).second)
+					heads[size].push_back(move(extensions[index]));
+				else
+					++result.merged_heads;
+			result.heads += extensions.size();
+		}
+	}
+
+	// the steps until the checks passed, nothing if they didn't within max_steps; a run also fails early once it stalled,
+	// or every active device stopped on an error and the messages still on their way had time to arrive, since nothing
+	// changes then
+	optional<size_t> RunSeed(PuzzleInstance& instance, uint64_t seed, size_t max_steps)
+	{
+		instance.Seed(seed);
+		instance.SetupForRun();
+
+		bool passed = false;
+		size_t halted_steps = 0;
+		while (!passed && !instance.Stalled() && instance.Steps() < max_steps && halted_steps <= puzzle.network_queue_depth)
+		{
+			passed = instance.Tick();
+			const auto halted = ranges::all_of(instance.VMs(), [](auto&& device) { return device->Passive() || !device->ErrorMessage().empty(); });
+			halted_steps = halted ? halted_steps + 1 : 0;
+		}
+
+		const auto steps = instance.Steps();
+		instance.Stop();
+		return passed ? make_optional(steps) : nullopt;
+	}
+
+	// runs the program against the seeds, giving up on the first one it fails or once it can't rank anymore
+	void Evaluate(Worker& worker, const vector<TMemory>& program, const vector<size_t>& instruction_addresses)
+	{
+		++run_program_count;
+		worker.Load(program);
+
+		SuperoptimizerCandidate candidate{ program, instruction_addresses };
+		for (auto seed = options.first_seed; seed < options.first_seed + options.seed_count; ++seed)
+		{
+			const auto bound = step_bound.load();
+			const auto budget = bound > candidate.total_steps ? min<uint64_t>(options.max_steps, bound - candidate.total_steps) : 0;
+			if (!budget)
+			{
+				++rejected_program_count;
+				return;
+			}
+
+			const auto steps = RunSeed(*worker.instance, seed, budget);
+			if (!steps)
+			{
+				++rejected_program_count;
+				return;
+			}
+			candidate.total_steps += *steps;
+			candidate.max_steps = max(candidate.max_steps, *steps);
+		}
+
+		lock_guard lock(candidates_mutex);
+		candidates.insert(ranges::upper_bound(candidates, candidate, [this](auto&& left, auto&& right) { return Better(left, right); }), move(candidate));
+		if (candidates.size() > options.candidate_count)
+			candidates.pop_back();
+		if (options.goal == SuperoptimizerGoal::Steps && candidates.size() == options.candidate_count)
+			step_bound = candidates.back().total_steps;
+	}
+
+	// completes the tail with instructions up to its size, then checks and runs it
+	void SearchTails(Worker& worker, Partial& partial)
+	{
+		if (partial.program.size() == partial.size)
+		{
+			++program_count;
+
+			// jumps land on instructions or right after the program, and a tail that goes on in a straight line has to be
+			// jumped to, its head would be longer otherwise
+			const auto boundary = [&](size_t target) { return target == partial.size || ranges::binary_search(partial.instruction_addresses, target); };
+			const auto head_jumped_to = ranges::find(partial.targets, partial.head_size) != partial.targets.end();
+			if (!ranges::all_of(partial.targets, boundary) || (partial.straight_line_tail && !head_jumped_to))
+			{
+				++pruned_program_count;
+				return;
+			}
+
+			Evaluate(worker, partial.program, partial.instruction_addresses);
+			return;
+		}
+
+		for (auto& choice : choices)
+			if (partial.program.size() + choice.bytes.size() <= partial.size)
+				AddChoice(worker, partial, choice);
+	}
+
+	void AddChoice(Worker& worker, Partial& partial, const Choice& choice)
+	{
+		const auto address = partial.program.size();
+		if (address == partial.head_size)
+			partial.straight_line_tail = choice.straight_line;
+		partial.instruction_addresses.push_back(address);
+		partial.program.insert(partial.program.end(), choice.bytes.begin(), choice.bytes.end());
+
+		if (choice.jump)
+			for (auto target = partial.head_size; target <= partial.size && target < (size_t(1) << (choice.target_bytes * 8)); ++target)
+			{
+				WriteLittleEndian(&partial.program[address + choice.target_offset], target, choice.target_bytes);
+				partial.targets.push_back(target);
+				SearchTails(worker, partial);
+				partial.targets.pop_back();
+			}
+		else
+			SearchTails(worker, partial);
+
+		partial.program.resize(address);
+		partial.instruction_addresses.pop_back();
+	}
+
+	// every program of exactly size bytes: each head of that size on its own, and every smaller head followed by each
+	// first tail instruction, spread over the pool as separate tasks
+	void SearchSize(size_t size)
+	{
+		vector<pair<const Head*, const Choice*>> tasks;
+		for (size_t head_size = 0; head_size <= size; ++head_size)
+			for (auto& head : heads[head_size])
+				if (head_size == size)
+					tasks.emplace_back(&head, nullptr);
+				else
+					for (auto& choice : choices)
+						if (head_size + choice.bytes.size() <= size)
+							tasks.emplace_back(&head, &choice);
+
+		pool.ParallelFor(tasks.size(), [&](size_t index)
+			{
+				WithWorker([&](Worker& worker)
+					{
+						auto [head, choice] = tasks[index];
+						if (choice)
+						{
+							Partial partial{ head->program, head->instruction_addresses, {}, head->program.size(), size };
+							AddChoice(worker, partial, *choice);
+						}
+						else
+						{
+							++program_count;
+							Evaluate(worker, head->program, head->instruction_addresses);
+						}
+					});
+			});
+	}
+
+public:
+	Superoptimizer(Puzzle& puzzle, const SuperoptimizerOptions& options)
+		: puzzle(puzzle), options(options), pool(options.thread_count)
+	{
+	}
+
+	SuperoptimizerResult Run()
+	{
+		SuperoptimizerResult result;
+		const auto start = chrono::steady_clock::now();
+
+		auto worker = MakeWorker();
+		max_program_size = min(options.max_program_size, worker->vm->MemorySize());
+		MakeChoices(*worker->vm);
+
+		// a setup that writes to the device can make a head read something else on every seed
+		for (auto seed = options.first_seed; seed < options.first_seed + options.seed_count && mergeable_heads; ++seed)
+		{
+			worker->instance->Seed(seed);
+			worker->instance->SetupForRun();
+			for (size_t address = 0; address < worker->vm->MemorySize() && mergeable_heads; ++address)
+				mergeable_heads = !worker->vm->Memory(address);
+			worker->instance->Stop();
+		}
+		idle_workers.push_back(move(worker));
+
+		FindHeads(result);
+
+		// sizes in increasing order, so the size goal is done once a size filled the candidates
+		for (size_t size = 0; size <= max_program_size; ++size)
+		{
+			SearchSize(size);
+			if (options.goal == SuperoptimizerGoal::Size && candidates.size() == options.candidate_count)
+				break;
+		}
+
+		result.candidates = move(candidates);
+		result.programs = program_count;
+		result.pruned_programs = pruned_program_count;
+		result.run_programs = run_program_count;
+		result.rejected_programs = rejected_program_count;
+		result.wall_time = chrono::steady_clock::now() - start;
+		return result;
+	}
+};
+
+// searches every program up to options.max_program_size bytes for the device for those that pass the puzzle's checks on
+// all the seeds, and returns the best of them
+export SuperoptimizerResult Superoptimize(Puzzle& puzzle, const SuperoptimizerOptions& options)
+{
+	return Superoptimizer(puzzle, options).Run();
+}
@@ -0,0 +1,95 @@
+module;
+
+#include "stdafx.h"
+
+export module thread_pool;
+
+import std;
+
+using namespace std;
+
+// a fixed set of worker threads running one ParallelFor at a time, with the calling thread pitching in
+export class ThreadPool
+{
+	vector<jthread> workers;
+
+	mutex job_mutex;
+	condition_variable_any job_started;
+	condition_variable job_finished;
+	uint64_t job_generation{};
+	size_t busy_workers{};
+
+	const function<void(size_t index)>* job_body{};
+	size_t job_count{};
+	atomic<size_t> job_next_index{};
+
+	void RunJob()
+	{
+		for (auto index = job_next_index++; index < job_count; index = job_next_index++)
+			(*job_body)(index);
+	}
+
+	void WorkerLoop(stop_token stop)
+	{
+		uint64_t seen_generation = 0;
+		while (true)
+		{
+			{
+				unique_lock lock(job_mutex);
+				if (!job_started.wait(lock, stop, [&] { return job_generation != seen_generation; }))
+					return;
+				seen_generation = job_generation;
+			}
+
+			RunJob();
+
+			lock_guard lock(job_mutex);
+			if (!--busy_workers)
+				job_finished.notify_one();
+		}
+	}
+
+public:
+	explicit ThreadPool(size_t thread_count = max(thread::hardware_concurrency(), 1u))
+	{
+		// the calling thread is one of the threads
+		for (size_t i = 1; i < thread_count; ++i)
+			workers.emplace_back([this](stop_token stop) { WorkerLoop(stop); });
+	}
+
+	~ThreadPool()
+	{
+		for (auto& worker : workers)
+			worker.request_stop();
+		workers.clear();
+	}
+
+	size_t ThreadCount() const { return workers.size() + 1; }
+
+	// runs body(index) for every index in [0, count), returns once all of them are done
+	void ParallelFor(size_t count, const function<void(size_t index)>& body)
+	{
+		if (workers.empty() || count <= 1)
+		{
+			for (size_t index = 0; index < count; ++index)
+				body(index);
+			return;
+		}
+
+		{
+			lock_guard lock(job_mutex);
+			job_body = &body;
+			job_count = count;
+			job_next_index = 0;
+			busy_workers = workers.size();
+			++job_generation;
+		}
+		job_started.notify_all();
+
+		RunJob();
+
+		unique_lock lock(job_mutex);
+		job_finished.wait(lock, [&] { return !busy_workers; });
+		job_body = nullptr;
+	}
+};
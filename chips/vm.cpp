@@ -1,6 +1,6 @@
 #include "stdafx.h"
 
-import std.core;
+import std;
 import vm;
 
 using namespace std;
@@ -8,31 +8,377 @@ using namespace std;
 void VM::SetupForRun()
 {
 	BaseMemory::SetupForRun();
+	InvalidateDecodedInstructions();
+
+	// every run starts from the same state, so it only depends on the memory and the seed
 	ip = 0;
+	jumped = false;
+	flags = {};
+	pending_reads.reset();
+	ranges::fill(registers, TRegister{});
+	profile = profiling ? make_unique<VMProfile>(memory.Size()) : nullptr;
+	pending_changes.ip = pending_changes.flags = true;
+	pending_changes.registers = ~0u;
+
+	recording_loop = looping = parked = false;
+	probe_activity = Activity();
+	probe_limit = 0;
+}
+
+void VM::Stop()
+{
+	BaseMemory::Stop();
+	InvalidateDecodedInstructions();
+}
+
+void VM::SaveRunState(DeviceRunState& state) const
+{
+	BaseMemory::SaveRunState(state);
+	state.ip = ip;
+	state.flag_zero = flags.zero;
+	state.pending_reads = pending_reads;
+}
+
+void VM::LoadRunState(const DeviceRunState& state)
+{
+	BaseMemory::LoadRunState(state);
+	ip = state.ip;
+	flags.zero = state.flag_zero;
+	pending_reads = state.pending_reads;
+	pending_changes.ip = pending_changes.flags = true;
+}
+
+void VM::OnMemoryWritten(size_t begin, size_t end)
+{
+	// drop every cached instruction whose bytes overlap the written range
+	const auto max_instruction_length = instructions->MaxInstructionLength();
+	const auto first = begin >= max_instruction_length ? begin - max_instruction_length + 1 : 0;
+	for (auto address = first; address < end; ++address)
+		if (auto& page = decoded_instructions[address >> PagedMemory::PageBits])
+			if (auto& decoded = (*page)[address & (PagedMemory::PageSize - 1)]; decoded.instruction && address + decoded.length > begin)
+				decoded.instruction = nullptr;
+
+	if (!translated_memory.empty() && any_of(translated_memory.begin() + begin, translated_memory.begin() + end, identity{}))
+		InvalidateTranslatedBlocks(begin, end);
+}
+
+void VM::InvalidateDecodedInstructions()
+{
+	for (auto& page : decoded_instructions)
+		page.reset();
+
+	for (auto& page : translated_blocks)
+		page.reset();
+	translated_memory.clear();
+	current_block = nullptr;
+	retired_block.reset();
+}
+
+const VM::TranslatedBlock* VM::TranslatedBlockAt(size_t address)
+{
+	auto& page = translated_blocks[address >> PagedMemory::PageBits];
+	if (!page)
+		page = make_unique<TTranslatedBlockPage>();
+	auto& slot = (*page)[address & (PagedMemory::PageSize - 1)];
+	if (slot)
+		return slot.get();
+
+	// up to and including the first instruction that jumps or talks to the network
+	auto block = make_unique<TranslatedBlock>();
+	vector<pair<size_t, size_t>> operand_ranges;
+	vector<size_t> operand_values;
+	auto next = address;
+	while (next < memory.Size() && block->instructions.size() < MaxTranslatedBlockInstructions)
+	{
+		array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+		const auto stream = memory.Read(next, span{ buffer }.first(instructions->MaxInstructionLength()));
+		const auto instruction = instructions->Find(stream);
+		if (!instruction || !instruction->semantics)
+			break;
+
+		if (!instruction->DecodeOperands(stream, 0, operand_values))
+			break;
+		operand_ranges.emplace_back(block->operand_values.size(), operand_values.size());
+		block->operand_values.insert(block->operand_values.end(), operand_values.begin(), operand_values.end());
+		block->instructions.push_back({ instruction->semantics, next, instruction->OpcodeLength(), {}, instruction->network });
+		next += instruction->OpcodeLength();
+		if (instruction->ends_block)
+			break;
+	}
+	if (block->instructions.empty())
+		return nullptr;
+
+	// the operand spans are only taken once the shared array stops growing
+	for (size_t i = 0; i < block->instructions.size(); ++i)
+		block->instructions[i].operand_values = span{ block->operand_values }.subspan(operand_ranges[i].first, operand_ranges[i].second);
+	block->begin = address;
+	block->end = next;
+	if (execution_tier == VMExecutionTier::Native)
+		CompileNativeCode(*block);
+	translated_memory.resize(memory.Size());
+	fill(translated_memory.begin() + block->begin, translated_memory.begin() + block->end, true);
+	slot = move(block);
+	return slot.get();
+}
+
+void VM::InvalidateTranslatedBlocks(size_t begin, size_t end)
+{
+	// blocks are never longer than this, so only the ones starting that far back can reach begin
+	const auto max_block_length = MaxTranslatedBlockInstructions * instructions->MaxInstructionLength();
+	for (auto address = begin >= max_block_length ? begin - max_block_length + 1 : 0; address < end; ++address)
+		if (auto& page = translated_blocks[address >> PagedMemory::PageBits])
+			if (auto& block = (*page)[address & (PagedMemory::PageSize - 1)]; block && block->end > begin)
+			{
+				if (block.get() == current_block)
+				{
+					current_block_position = current_block->instructions.size();
+					retired_block = move(block);
+				}
+				block.reset();
+			}
 }
 
 void VM::Step()
 {
+	if (!detect_loops)
+	{
+		ExecuteNextInstruction();
+		return;
+	}
+
+	// anything reaching the device ends the loop it was in or being recorded
+	if ((looping || recording_loop) && Activity() != loop_activity)
+		looping = recording_loop = false;
+
+	if (recording_loop)
+	{
+		if (loop_length && SameRunState(loop.front().state))
+		{
+			// back where the lap started, it goes around the same way from here on
+			recording_loop = false;
+			looping = true;
+			loop_phase = 0;
+			lap_failed_sends = Traffic().failed_sends - loop.front().failed_sends;
+		}
+		else if (loop_length == MaxLoopLength)
+			recording_loop = false;
+		else
+		{
+			if (loop.size() == loop_length)
+				loop.emplace_back();
+			SaveRunState(loop[loop_length].state);
+			loop[loop_length].failed_sends = Traffic().failed_sends;
+			++loop_length;
+		}
+	}
+
+	if (looping)
+	{
+		if (parking_allowed && !profile)
+		{
+			parked = true;
+			return;
+		}
+
+		// stepped around the lap instead, as long as nothing set another state from outside
+		if (SameRunState(loop[loop_phase].state))
+			loop_phase = (loop_phase + 1) % loop_length;
+		else
+			looping = false;
+	}
+
+	const auto old_ip = ip;
 	ExecuteNextInstruction();
+
+	// every loop jumps back, or stays put on an error
+	if (!looping && !recording_loop)
+	{
+		++probe_distance;
+		if (ip <= old_ip)
+			ProbeLoop();
+	}
+}
+
+size_t VM::StepAlone(size_t max_steps)
+{
+	// the profiler counts every step, and a loop being recorded or gone around is compared with the state before each one
+	if ((execution_tier != VMExecutionTier::Translated && execution_tier != VMExecutionTier::Native) || profile || recording_loop || looping)
+		return 0;
+
+	size_t steps = 0;
+	while (steps < max_steps && ip < memory.Size())
+	{
+		if (!current_block || current_block_position >= current_block->instructions.size()
+			|| current_block->instructions[current_block_position].address != ip)
+		{
+			retired_block.reset();
+			current_block = TranslatedBlockAt(ip);
+			current_block_position = 0;
+			if (!current_block)
+				break;
+		}
+
+		// native code leaves after a jump, so only the last instruction it ran can have gone back
+		if (current_block->native && current_block_position < current_block->native->entries.size())
+		{
+			const auto block = current_block;
+			const auto position = current_block_position;
+			const auto executed = ExecuteNativeCode(max_steps - steps);
+			steps += executed;
+			if (detect_loops)
+			{
+				probe_distance += executed;
+				if (ip <= block->instructions[position + executed - 1].address)
+					ProbeLoop();
+				if (recording_loop)
+					break;
+			}
+			if (watched_memory_changed)
+				break;
+			continue;
+		}
+
+		// an instruction that fails does so before changing anything, the tick reports it
+		const auto& instruction = current_block->instructions[current_block_position];
+		const auto old_ip = ip;
+		if (instruction.network || !instruction.semantics(*this, old_ip, instruction.operand_values))
+			break;
+		++current_block_position;
+		if (!exchange(jumped, false))
+			ip = (ip + static_cast<TAddress>(instruction.length)) & address_mask;
+		++steps;
+
+		// the same loop detection as Step, which takes over once a lap is being recorded
+		if (detect_loops)
+		{
+			++probe_distance;
+			if (ip <= old_ip)
+				ProbeLoop();
+			if (recording_loop)
+				break;
+		}
+		if (watched_memory_changed)
+			break;
+	}
+	return steps;
+}
+
+void VM::ProbeLoop()
+{
+	// a probe is only saved once a lap went by with the activity unchanged, a loop reached every lap never gets one
+	if (Activity() != probe_activity)
+	{
+		probe_activity = Activity();
+		probe_limit = 0;
+		return;
+	}
+
+	if (probe_limit)
+	{
+		// came around to the probe, the next lap is recorded
+		if (SameRunState(loop_probe))
+		{
+			recording_loop = true;
+			loop_length = 0;
+			loop_activity = probe_activity;
+			return;
+		}
+		if (probe_distance < probe_limit)
+			return;
+	}
+
+	probe_limit = clamp<size_t>(probe_limit * 2, 1, MaxLoopLength);
+	SaveRunState(loop_probe);
+	probe_distance = 0;
+}
+
+bool VM::SameRunState(const DeviceRunState& state) const
+{
+	return ip == state.ip && flags.zero == state.flag_zero && registers == state.registers && pending_reads == state.pending_reads
+		&& error_message == state.error_message;
+}
+
+void VM::Resume(size_t parked_steps)
+{
+	// the lap went around the same way every tick it was parked for, failing the same sends
+	const auto position = loop_phase + parked_steps;
+	const auto& step = loop[position % loop_length];
+	LoadRunState(step.state);
+	CountFailedSends(position / loop_length * lap_failed_sends + step.failed_sends - loop[loop_phase].failed_sends);
+	loop_phase = position % loop_length;
+	parked = false;
 }
 
 bool VM::ExecuteNextInstruction()
 {
 #define ERROR_RETURN(msg) do{ error_message = (msg); return false; }while(0)
 	const auto ip = static_cast<size_t>(this->ip);
-	if (ip >= memory.size())
-		ERROR_RETURN(format("IP ({:#04x}) is out of bounds ({:#04x}).", ip, memory.size()));
+	if (ip >= memory.Size())
+		ERROR_RETURN(format("IP ({:#0{}x}) is out of bounds ({:#0{}x}).", ip, 2 + address_bytes * 2, memory.Size(), 2 + address_bytes * 2));
+	if (profile)
+		profile->CountExecution(ip, memory.Read(ip));
+
+	if (execution_tier == VMExecutionTier::Translated || execution_tier == VMExecutionTier::Native)
+	{
+		// carry on in the current block unless the last instruction left it, look the block up otherwise;
+		// where none can be translated the interpreter below runs the instruction, or reports why it can't
+		if (!current_block || current_block_position >= current_block->instructions.size()
+			|| current_block->instructions[current_block_position].address != ip)
+		{
+			retired_block.reset();
+			current_block = TranslatedBlockAt(ip);
+			current_block_position = 0;
+		}
+
+		if (current_block)
+		{
+			const auto& instruction = current_block->instructions[current_block_position++];
+			if (!instruction.semantics(*this, ip, instruction.operand_values))
+				ERROR_RETURN("Internal instruction error.");
+
+			if (!exchange(jumped, false))
+				this->ip = (this->ip + static_cast<TAddress>(instruction.length)) & address_mask;
+			return true;
+		}
+	}
+
+	if (execution_tier == VMExecutionTier::Compiled)
+	{
+		const auto handler = (*compiled_instructions)[memory.Read(ip)];
+		if (!handler)
+			ERROR_RETURN("Invalid instruction opcode.");
+		const auto length = handler(*this, ip);
+		if (!length)
+			ERROR_RETURN("Internal instruction error.");
+
+		if (!exchange(jumped, false))
+			this->ip = (this->ip + static_cast<TAddress>(length)) & address_mask;
+		return true;
+	}
+
+	auto& decoded = DecodedInstructionAt(ip);
+	if (!decoded.instruction)
+	{
+		array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+		const auto stream = memory.Read(ip, span{ buffer }.first(instructions->MaxInstructionLength()));
+		auto instruction = instructions->Find(stream);
+		if (!instruction)
+			ERROR_RETURN("Invalid instruction opcode.");
+		if (!instruction->DecodeOperands(stream, 0, decoded.operand_values))
+			ERROR_RETURN("Internal instruction error.");
 
-	auto it = instructions.find((size_t)Memory(ip));
-	if (it == instructions.end())
-		ERROR_RETURN("Invalid instruction opcode.");
+		decoded.instruction = instruction;
+		decoded.length = instruction->OpcodeLength();
+	}
 
-	const auto& instruction = it->second;
-	if (!instruction.Execute(*this, ip))
+	// the handler may overwrite its own bytes, which only clears decoded.instruction, so operand_values stays valid
+	const auto& instruction = *decoded.instruction;
+	const auto length = decoded.length;
+	if (!instruction.execute_internal || !instruction.execute_internal(instruction, *this, ip, decoded.operand_values))
 		ERROR_RETURN("Internal instruction error.");
-	GlobalEventQueue.enqueue(GlobalEventType::VMInstructionExecuted, this);
 
-	this->ip += static_cast<TRegister>(instruction.OpcodeLength());
+	if (!exchange(jumped, false))
+		this->ip = (this->ip + static_cast<TAddress>(length)) & address_mask;
 	return true;
 #undef ERROR_RETURN
 }
\ No newline at end of file
@@ -7,49 +7,319 @@ export module vm;
 import std;
 
 using namespace std;
-using namespace ftxui;
 
 export using TMemory = uint8_t;
 export using TRegister = uint8_t;
-export using TAddress = uint8_t;
+// holds an address of any machine, each encodes them in its own AddressBytes()
+export using TAddress = uint32_t;
 
+// a network message: the address, and the value to write or nullopt for a read request
+export using TNetworkData = tuple<TAddress, optional<TRegister>>;
+
+class BaseMemory;
 class VM;
 
 export template<size_t Bytes>
-struct Imm { static const size_t ByteSize = Bytes; };
-export struct Addr { static const size_t ByteSize = sizeof(TAddress); };
-export struct Reg { static const size_t ByteSize = sizeof(TRegister); };
+struct Imm { static constexpr size_t ByteSize = Bytes; };
+// as wide as the address space of the machine it runs on
+export struct Addr {};
+export struct Reg { static constexpr size_t ByteSize = sizeof(TRegister); };
+
+export template<typename TOperand>
+constexpr size_t OperandByteSize(size_t address_bytes)
+{
+	if constexpr (is_same_v<TOperand, Addr>)
+		return address_bytes;
+	else
+		return TOperand::ByteSize;
+}
+
+// the bytes needed to address memory_size bytes
+export constexpr size_t AddressBytesFor(size_t memory_size)
+{
+	return max<size_t>(1, (bit_width(max<size_t>(memory_size, 1) - 1) + 7) / 8);
+}
+
+// operands are stored little endian
+export constexpr size_t ReadLittleEndian(const TMemory* stream, size_t byte_size)
+{
+	size_t value = 0;
+	for (auto i = byte_size; i-- > 0; )
+		value = value << 8 | stream[i];
+	return value;
+}
+
+// compiled instruction handlers return the executed instruction's length, or 0 on error
+export using TCompiledInstructionHandler = size_t(*)(VM& vm, size_t memory_index);
+export using TCompiledInstructionDispatch = array<TCompiledInstructionHandler, 256>;
+// an instruction's semantics on its decoded operands, as bound into translated blocks
+export using TInstructionSemantics = bool(*)(VM& vm, size_t memory_index, span<const size_t> operand_values);
+
+export enum class VMExecutionTier
+{
+	Interpreted,
+	Compiled,
+	Translated,
+	// translated blocks compiled to x86-64 code, on Linux x86-64 hosts only; ticking runs them as translated blocks, a VM
+	// stepping alone runs their code
+	Native,
+};
 
 export struct VMInstruction
 {
 	using TOperand = variant<Imm<1>, Imm<2>, Imm<4>, Addr, Reg>;
 
 	const char* name;
-	Element description_element;
+	string description_markup;
 	const vector<TMemory> base_opcode;
 	const vector<TOperand> operands;
+	const size_t address_bytes;
+	const size_t opcode_length;
 	function<bool(const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values)> execute_internal;
+	// the same as a plain function for the translated tier, null if there is none
+	TInstructionSemantics semantics{};
+	// jumps and network instructions end translated blocks
+	bool ends_block{};
+	// the instructions that talk to the network, which a VM stepping alone stops before
+	bool network{};
 
 	VMInstruction(const char* name, const vector<TMemory> base_opcode, const vector<TOperand> operands, const char* base_description_markup,
-		function<bool(const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values)> execute_internal);
+		function<bool(const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values)> execute_internal,
+		size_t address_bytes = 1);
 
-	size_t OpcodeLength() const;
+	size_t OpcodeLength() const { return opcode_length; }
 
 	bool OpcodeValid(const span<const uint8_t> stream) const
 	{
 		return stream.size() >= OpcodeLength() && ranges::equal(stream.subspan(0, base_opcode.size()), base_opcode);
 	}
 
+	bool DecodeOperands(const span<const TMemory> memory, size_t memory_index, vector<size_t>& operand_values) const;
 	bool Execute(VM& vm, size_t memory_index) const;
 
 	optional<string> Decode(const BaseMemory* memory, size_t memory_index) const;
 };
 
+// dense opcode dispatch: one direct-indexed 256 entry node per opcode byte, with longer opcodes chained through prefix nodes;
+// all its instructions share one address width
+export class VMInstructionTable
+{
+public:
+	static constexpr size_t MaxInstructionBytes = 16;
+
+private:
+	struct Node
+	{
+		array<uint16_t, 256> instruction{};		// 1-based index into instructions, 0 if none
+		array<uint16_t, 256> prefix{};			// index of the node for the next opcode byte, 0 if none
+	};
+
+	vector<VMInstruction> instructions;
+	vector<Node> nodes = vector<Node>(1);
+	size_t max_instruction_length{};
+	size_t address_bytes = 1;
+
+public:
+	VMInstructionTable(const vector<VMInstruction>& instructions);
+
+	const VMInstruction* Find(const span<const TMemory> stream) const
+	{
+		uint16_t node = 0;
+		for (auto byte : stream)
+		{
+			const auto& current = nodes[node];
+			if (auto instruction = current.instruction[byte])
+				return &instructions[instruction - 1];
+			if (!(node = current.prefix[byte]))
+				return nullptr;
+		}
+		return nullptr;
+	}
+
+	const auto& Instructions() const { return instructions; }
+	auto MaxInstructionLength() const { return max_instruction_length; }
+	auto AddressBytes() const { return address_bytes; }
+};
+
+// byte addressable memory made of pages allocated on their first write, reading as zero until then;
+// copies share their pages until either side writes to one, so a snapshot only costs the pages written after it
+export class PagedMemory
+{
+public:
+	static constexpr size_t PageBits = 8;
+	static constexpr size_t PageSize = size_t(1) << PageBits;
+
+private:
+	size_t size{};
+	vector<shared_ptr<vector<TMemory>>> pages;
+
+	vector<TMemory>& UnsharePage(size_t page);
+
+public:
+	PagedMemory() = default;
+	explicit PagedMemory(size_t size) : size(size), pages((size + PageSize - 1) / PageSize) {}
+
+	size_t Size() const { return size; }
+	size_t PageCount() const { return pages.size(); }
+	size_t AllocatedSize() const
+	{
+		size_t allocated = 0;
+		for (auto& page : pages)
+			allocated += page ? page->size() : 0;
+		return allocated;
+	}
+
+	// index must be in range
+	TMemory Read(size_t index) const
+	{
+		const auto& page = pages[index >> PageBits];
+		return page ? (*page)[index & (PageSize - 1)] : 0;
+	}
+
+	void Write(size_t index, TMemory value)
+	{
+		auto& page = pages[index >> PageBits];
+		(page && page.use_count() == 1 ? *page : UnsharePage(index >> PageBits))[index & (PageSize - 1)] = value;
+	}
+
+	// copies values to index, which must fit
+	void Write(size_t index, span<const TMemory> values);
+
+	// up to buffer.size() bytes from index, fewer at the end of the memory; they are read in place when they lie
+	// in a single allocated page, copied into buffer otherwise
+	span<const TMemory> Read(size_t index, span<TMemory> buffer) const;
+};
+
+// bounded FIFO of the messages one sender has queued for one receiver
+export class NetworkQueue
+{
+	vector<TNetworkData> items;
+	size_t head{}, size{};
+
+public:
+	explicit NetworkQueue(size_t depth) : items(max<size_t>(depth, 1)) {}
+
+	size_t Depth() const { return items.size(); }
+	size_t Size() const { return size; }
+	bool Empty() const { return !size; }
+	bool Full() const { return size == items.size(); }
+
+	const TNetworkData& Front() const { assert(size); return items[head]; }
+
+	void Push(const TNetworkData& data)
+	{
+		assert(!Full());
+		items[(head + size++) % items.size()] = data;
+	}
+
+	void Pop()
+	{
+		assert(size);
+		head = (head + 1) % items.size();
+		--size;
+	}
+
+	// the reverse of Push and Pop, for stepping back
+	void PopBack() { assert(size); --size; }
+	void PushFront(const TNetworkData& data)
+	{
+		assert(!Full());
+		head = (head + items.size() - 1) % items.size();
+		items[head] = data;
+		++size;
+	}
+};
+
+// the device state besides its memory and incoming data, as saved by checkpoints and the undo log
+export struct DeviceRunState
+{
+	vector<TRegister> registers;
+	TAddress ip{};
+	bool flag_zero{};
+	bitset<numeric_limits<TIndexInNetwork>::max() + 1> pending_reads;
+	string error_message;
+
+	bool operator==(const DeviceRunState&) const = default;
+};
+
+// the messages a device sent over one run, and the most any sender had queued for it at once
+export struct NetworkTraffic
+{
+	uint64_t messages_sent{}, failed_sends{};
+	size_t peak_queue_occupancy{};
+};
+
+// a device at one step of a run; its memory shares the pages not written since with the device and other checkpoints
+export struct DeviceCheckpoint
+{
+	PagedMemory memory;
+	DeviceRunState run_state;
+	unordered_map<TIndexInNetwork, NetworkQueue> incoming_data;
+	NetworkTraffic network_traffic;
+};
+
+// the devices of every network of a puzzle instance, by network index and index in network;
+// built once and shared by all of them, it doesn't own the devices
+export class NetworkTopology
+{
+	vector<vector<BaseMemory*>> networks;
+
+public:
+	void Add(BaseMemory& device);
+
+	BaseMemory* Device(TNetworkIndex network_index, TIndexInNetwork index_in_network) const
+	{
+		if (network_index >= networks.size() || index_in_network >= networks[network_index].size())
+			return nullptr;
+		return networks[network_index][index_in_network];
+	}
+};
+
+// coalesced record of what changed on a device: dirty byte ranges plus register, IP, flag and property bits
+export struct MemoryChanges
+{
+	static constexpr size_t MaxMemoryRanges = 8;
+
+	vector<pair<size_t, size_t>> memory_ranges;		// sorted, disjoint [begin, end) byte ranges
+	uint32_t registers{};
+	bool ip{}, flags{}, properties{};
+
+	static MemoryChanges All(size_t memory_size)
+	{
+		MemoryChanges changes{ .registers = ~0u, .ip = true, .flags = true, .properties = true };
+		changes.AddMemoryRange(0, memory_size);
+		return changes;
+	}
+
+	bool Empty() const { return memory_ranges.empty() && !registers && !ip && !flags && !properties; }
+	bool MemoryDirty(size_t begin, size_t end) const
+	{
+		return ranges::any_of(memory_ranges, [=](auto&& range) { return range.first < end && begin < range.second; });
+	}
+
+	void MemoryWritten(size_t index)
+	{
+		// most writes land in or right after an already dirty range
+		for (auto& range : memory_ranges)
+			if (index >= range.first && index <= range.second)
+			{
+				if (index == range.second)
+					AddMemoryRange(index, index + 1);
+				return;
+			}
+		AddMemoryRange(index, index + 1);
+	}
+
+	void AddMemoryRange(size_t begin, size_t end);
+	void Merge(const MemoryChanges& other);
+	void Clear() { *this = {}; }
+};
+
 export class BaseMemory
 {
 public:
 	BaseMemory(size_t memory_size, bool interactive)
-		: memory(memory_size), saved_memory(memory_size), interactive(interactive)
+		: memory(memory_size), saved_memory(memory_size), address_bytes(AddressBytesFor(memory_size)), interactive(interactive)
 	{
 	}
 
@@ -61,110 +331,419 @@ private:
 
 	virtual bool ExecuteNextInstruction() = 0;
 
+	// changes published so far, the newest being generation change_generation
+	static constexpr size_t MaxPublishedChanges = 64;
+	deque<MemoryChanges> published_changes;
+	uint64_t change_generation = 1;
+	mutable mutex changes_mutex;
+
 protected:
-	vector<TMemory> memory, saved_memory;
+	MemoryChanges pending_changes;
+
+	// [begin, end) was written
+	virtual void OnMemoryWritten(size_t begin, size_t end) {}
+	virtual void OnMemoryRestored() {}
+
+	// bytes the puzzle checks depend on, and whether any of them changed value since it last looked
+	vector<bool> watched_memory;
+	bool watched_memory_changed{};
+
+	virtual void SaveRunState(DeviceRunState& state) const;
+	virtual void LoadRunState(const DeviceRunState& state);
+	// the sends a parked loop would have failed
+	void CountFailedSends(uint64_t count) { network_traffic.failed_sends += count; }
+
+	PagedMemory memory, saved_memory;
+	size_t address_bytes;
 	string error_message;
 	vector<TRegister> registers;
-	unordered_map<size_t, const VMInstruction> instructions;
-	unordered_map<TNetworkIndex, unordered_map<TIndexInNetwork, shared_ptr<BaseMemory>>> network_vms;
-	unordered_map<TIndexInNetwork, optional<tuple<TMemory, optional<TRegister>>>> incoming_data;
+	shared_ptr<const VMInstructionTable> instructions;
+	shared_ptr<const NetworkTopology> network_topology;
+	// the messages queued by each sender, frozen while the devices step and only changed by the commit phase
+	unordered_map<TIndexInNetwork, NetworkQueue> incoming_data;
+
+private:
+	size_t network_queue_depth = 1;
+	// counted from the start of the run up to the current tick: checkpoints and the undo log keep it, so stepping back
+	// or jumping to a tick gives what it was on that tick
+	NetworkTraffic network_traffic;
+	// the messages in incoming_data, from every sender together
+	size_t incoming_message_count{};
+	// bumped by everything that changes what the device sees or did to the others: a delivery to it, a change to its memory,
+	// a message it consumed or sent, one it sent being consumed; a failed send only adds to the traffic, which a device
+	// going around a loop without its activity changing makes up for when it resumes
+	uint64_t activity{};
+
+	// what this step sent and consumed, applied once every device stepped
+	vector<tuple<BaseMemory*, TNetworkData>> outgoing_data;
+	vector<TIndexInNetwork> consumed_data;
+
+	// while recording, every tick logs the previous values of the memory it wrote, the changes to its inbox in order
+	// (a consumed message, or nullopt for one received), and the run state and traffic before it; run states are
+	// reused across clears
+	struct UndoTickMarks { size_t memory_writes, inbox_changes; NetworkTraffic network_traffic; };
+	bool undo_recording{};
+	vector<UndoTickMarks> undo_ticks;
+	vector<DeviceRunState> undo_run_states;
+	vector<pair<size_t, TMemory>> undo_memory_writes;
+	vector<pair<TIndexInNetwork, optional<TNetworkData>>> undo_inbox_changes;
 
 public:
 	auto Name() const { return name; }
-	void Name(const string_view value) { name = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void Name(const string_view value) { name = value; pending_changes.properties = true; }
 
 	auto Editable() const { return editable; }
-	void Editable(bool value) { editable = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void Editable(bool value) { editable = value; pending_changes.properties = true; }
 
 	auto Interactive() const { return interactive; }
 
 	auto NetworkIndex() const { return network_index; }
-	void NetworkIndex(TNetworkIndex value) { network_index = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void NetworkIndex(TNetworkIndex value) { network_index = value; pending_changes.properties = true; }
 
 	auto IndexInNetwork() const { return index_in_network; }
-	void IndexInNetwork(TIndexInNetwork value) { index_in_network = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void IndexInNetwork(TIndexInNetwork value) { index_in_network = value; pending_changes.properties = true; }
 
-	void AddNetworkedVM(TNetworkIndex network_index, TIndexInNetwork index_in_network, shared_ptr<BaseMemory> vm)
-	{
-		network_vms[network_index][index_in_network] = vm;
-	}
-	optional<shared_ptr<BaseMemory>> NetworkVM(TNetworkIndex network_index, TIndexInNetwork index_in_network) const;
-	optional<shared_ptr<BaseMemory>> NetworkVM(TIndexInNetwork index_in_network) const
-	{
-		return NetworkVM(network_index, index_in_network);
-	}
+	void Topology(shared_ptr<const NetworkTopology> value) { network_topology = move(value); }
 
-	bool IncomingData(TIndexInNetwork index_in_network, optional<tuple<TMemory, optional<TRegister>>> data, bool force = false)
+	// the device at index_in_network in our network, or null
+	BaseMemory* NetworkVM(TIndexInNetwork index_in_network) const
 	{
-		if (!force && incoming_data[index_in_network].has_value())
-			return false;
-		incoming_data[index_in_network] = data;
-		return true;
+		return network_topology ? network_topology->Device(network_index, index_in_network) : nullptr;
 	}
-	optional<tuple<TMemory, optional<TRegister>>> IncomingData(TIndexInNetwork index_in_network) const;
+
+	// how many messages each sender can have queued for this device
+	auto NetworkQueueDepth() const { return network_queue_depth; }
+	void NetworkQueueDepth(size_t value) { network_queue_depth = max<size_t>(value, 1); }
+
+	// the oldest message queued by the device at index_in_network
+	optional<TNetworkData> IncomingData(TIndexInNetwork index_in_network) const;
+	size_t IncomingDataCount(TIndexInNetwork index_in_network) const;
+
+	// queues data for the device at index_in_network, fails if there is none or our queue to it is full
+	bool SendData(TIndexInNetwork index_in_network, const TNetworkData& data);
+	bool CanSendData(TIndexInNetwork index_in_network) const;
+	const NetworkTraffic& Traffic() const { return network_traffic; }
+	// drops the oldest message received from index_in_network at the next commit
+	void ConsumeIncomingData(TIndexInNetwork index_in_network) { consumed_data.push_back(index_in_network); ++activity; }
+	// whether any sender has a message waiting for us
+	bool HasIncomingData() const { return incoming_message_count; }
+	auto Activity() const { return activity; }
+
+	// the commit phase of a tick: first every device drops what it consumed, then every device delivers what it sent
+	void CommitConsumedData();
+	void CommitOutgoingData();
 
 	string ErrorMessage() const { return error_message; }
 
 	bool Memory(size_t index, const TMemory value) 
 	{
-		if (index >= memory.size())
+		if (index >= memory.Size())
 			return false;
 
-		memory[index] = value;
-		GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); 
+		const auto old_value = memory.Read(index);
+		if (undo_recording)
+			undo_memory_writes.emplace_back(index, old_value);
+		if (!watched_memory.empty() && watched_memory[index] && old_value != value)
+			watched_memory_changed = true;
+		memory.Write(index, value);
+		OnMemoryWritten(index, index + 1);
+		pending_changes.MemoryWritten(index);
+		// writing the value already there changes nothing a loop could notice
+		if (old_value != value)
+			++activity;
 		return true;
 	}
 
-	auto Memory() { return span{ memory }; }
-	const auto Memory(size_t index) const { return index >= memory.size() ? 0 : memory[index]; }	// TODO fix errors here
-	const auto Memory(const pair<size_t, size_t> range) const { return span{ memory }.subspan(range.first, range.second); }
+	// writes a whole block at once, fails without writing anything if it doesn't fit
+	bool CopyToMemory(size_t index, span<const TMemory> values);
 
-	const auto MemorySize() const { return memory.size(); }
+	const TMemory Memory(size_t index) const { return index >= memory.Size() ? 0 : memory.Read(index); }	// TODO fix errors here
+	// up to buffer.size() bytes from index, see PagedMemory::Read
+	span<const TMemory> Memory(size_t index, span<TMemory> buffer) const { return memory.Read(index, buffer); }
 
-	size_t IndexFromOpcode(const vector<TMemory>& opcode) const;
+	const auto MemorySize() const { return memory.Size(); }
+	// the bytes of the pages written so far
+	auto AllocatedMemorySize() const { return memory.AllocatedSize(); }
+	// how many bytes encode an address of this device
+	auto AddressBytes() const { return address_bytes; }
+
+	// the instruction whose opcode starts at memory_index, null if none does
+	const VMInstruction* FindInstruction(size_t memory_index) const;
 	optional<string> DecodeInstruction(size_t memory_index) const;
+	// the most bytes decoding an instruction looks at
+	size_t MaxInstructionLength() const { return instructions ? instructions->MaxInstructionLength() : 1; }
 
 	auto RegisterName(int index) const { return format("R{}", index); }
 
-	auto&& Instructions() const { return instructions; }
+	const auto& Instructions() const { return instructions->Instructions(); }
+
+	// moves the pending changes into the published history, returns whether there were any
+	bool PublishChanges();
+	// everything published after generation, which is then advanced to the latest one; generation 0 reports everything
+	MemoryChanges ChangesSince(uint64_t& generation) const;
+
+	// watches [begin, end) for value changes, reported once by TakeWatchedMemoryChanged
+	void WatchMemory(size_t begin, size_t end)
+	{
+		watched_memory.resize(memory.Size());
+		fill(watched_memory.begin() + min(begin, memory.Size()), watched_memory.begin() + min(end, memory.Size()), true);
+	}
+	void ClearMemoryWatches() { watched_memory.clear(); watched_memory_changed = false; }
+	bool TakeWatchedMemoryChanged() { return exchange(watched_memory_changed, false); }
+
+	// a checkpoint of the whole device state; restoring it drops the undo log
+	DeviceCheckpoint Checkpoint() const;
+	void Restore(const DeviceCheckpoint& checkpoint);
+
+	// brackets one tick of the undo log, UndoTick reverts the newest one
+	void BeginUndoTick();
+	void EndUndoTick() { undo_recording = false; }
+	bool UndoTick();
+	void ClearUndo();
 
-	virtual void SetupForRun() { saved_memory = memory; }
+	virtual void SetupForRun();
 	virtual void Step() = 0;
-	virtual void Stop() { memory = saved_memory; error_message.clear(); }
+	// runs up to max_steps steps back to back, as many ticks as they take, as long as the device is the only thing in the
+	// puzzle that changes: it stops before anything that talks to the network, right after a write to a watched byte,
+	// and wherever Step has more to do than run the instruction; returns how many ran, 0 if it can't, see
+	// PuzzleInstance::RunToCompletion
+	virtual size_t StepAlone(size_t max_steps) { return 0; }
+
+	// memories only react to messages: they handle them during the commit phase, right as they are delivered,
+	// instead of stepping with the other devices, so their answers reach the requesters by the next tick
+	virtual bool Passive() const { return false; }
+
+	// a device going around a loop with its activity unchanged goes around it forever: with detection on, a VM finds such
+	// loops, and parks instead of stepping when allowed, until its activity changes; resuming after the ticks it was parked
+	// for leaves it where stepping would have, see VM::Step
+	virtual void DetectLoops(bool detect, bool park) {}
+	// the steps one lap of the loop the device goes around takes, 0 unless it is in one
+	virtual size_t LoopLength() const { return 0; }
+	virtual bool Parked() const { return false; }
+	virtual void Resume(size_t parked_steps) {}
+	virtual void Stop() { memory = saved_memory; error_message.clear(); pending_changes.AddMemoryRange(0, memory.Size()); }
+};
+
+// what a VM's program did during one run, counted while profiling is on; steps replayed after going back in the
+// history are counted again
+export struct VMProfile
+{
+	// per address
+	vector<uint64_t> executions, reads, writes;
+	// per first opcode byte
+	array<uint64_t, 256> opcode_executions{};
+	uint64_t steps{}, in_stalls{}, xfer_stalls{}, out_failures{};
+	// the largest count per address of each kind, to scale them by
+	uint64_t max_executions{}, max_reads{}, max_writes{};
+
+	explicit VMProfile(size_t memory_size)
+		: executions(memory_size), reads(memory_size), writes(memory_size)
+	{
+	}
+
+	void CountExecution(size_t address, TMemory opcode)
+	{
+		++steps;
+		++opcode_executions[opcode];
+		max_executions = max(max_executions, ++executions[address]);
+	}
+	void CountRead(size_t address) { max_reads = max(max_reads, ++reads[address]); }
+	void CountWrite(size_t address) { max_writes = max(max_writes, ++writes[address]); }
 };
 
 export class VM : public BaseMemory
 {
-	TRegister ip{};
+	TAddress ip{}, address_mask{};
+	// set by Jump, so the executed instruction doesn't advance the IP
+	bool jumped{};
 
 	struct {
 		bool zero : 1;
-	} flags;
+	} flags{};
+
+	// instructions decoded at each address, filled in on first execution and dropped when any of their bytes are written;
+	// kept in pages like the memory, allocated when an instruction in them first runs
+	struct DecodedInstruction
+	{
+		const VMInstruction* instruction{};
+		size_t length{};
+		vector<size_t> operand_values;
+	};
+	using TDecodedInstructionPage = array<DecodedInstruction, PagedMemory::PageSize>;
+	vector<unique_ptr<TDecodedInstructionPage>> decoded_instructions;
+
+	DecodedInstruction& DecodedInstructionAt(size_t address)
+	{
+		auto& page = decoded_instructions[address >> PagedMemory::PageBits];
+		if (!page)
+			page = make_unique<TDecodedInstructionPage>();
+		return (*page)[address & (PagedMemory::PageSize - 1)];
+	}
+
+	// the translated tier's straight-line blocks by start address, decoded once and bound to their instructions' semantics;
+	// a tick runs one of their instructions, carrying on in the current block until something jumps out of it, while a VM
+	// stepping alone runs them back to back, see StepAlone
+	struct TranslatedInstruction
+	{
+		TInstructionSemantics semantics;
+		size_t address, length;
+		span<const size_t> operand_values;
+		bool network;
+	};
+	// machine code for the leading instructions of a translated block that the native tier can run, see vm_jit.cpp
+	struct NativeCode
+	{
+		TMemory* code{};
+		size_t code_size{};
+		// where each of those instructions starts in code
+		vector<uint32_t> entries;
+
+		NativeCode() = default;
+		NativeCode(const NativeCode&) = delete;
+		NativeCode& operator=(const NativeCode&) = delete;
+		~NativeCode();
+	};
+	struct TranslatedBlock
+	{
+		size_t begin, end;
+		vector<TranslatedInstruction> instructions;
+		// every instruction's operands back to back, so running the block stays in two arrays
+		vector<size_t> operand_values;
+		shared_ptr<const NativeCode> native;
+	};
+	static constexpr size_t MaxTranslatedBlockInstructions = 64;
+	using TTranslatedBlockPage = array<unique_ptr<const TranslatedBlock>, PagedMemory::PageSize>;
+	vector<unique_ptr<TTranslatedBlockPage>> translated_blocks;
+	// addresses some block was translated from, so writes anywhere else skip looking for blocks to drop
+	vector<bool> translated_memory;
+	// a dropped current block is kept until the next step, its instruction might be the one that overwrote it
+	const TranslatedBlock* current_block{};
+	size_t current_block_position{};
+	unique_ptr<const TranslatedBlock> retired_block;
+
+	const TranslatedBlock* TranslatedBlockAt(size_t address);
+	void InvalidateTranslatedBlocks(size_t begin, size_t end);
+
+	// what the native code works on: it keeps the registers and the zero flag in host registers while it runs,
+	// and only calls back into the VM to access memory
+	struct NativeState
+	{
+		VM* vm;
+		uint64_t budget;
+		TAddress ip;
+		TRegister registers[2];
+		uint8_t zero;
+	};
+	static TMemory NativeLoad(NativeState* state, size_t address);
+	static bool NativeStore(NativeState* state, size_t address, TMemory value);
+	void CompileNativeCode(TranslatedBlock& block) const;
+	// runs the current block's native code from the current position for up to budget instructions, returns how many ran;
+	// a budget of more than one runs them back to back like StepAlone, only it can take them
+	size_t ExecuteNativeCode(size_t budget);
+
+	// sources with an unanswered IN request, so deeper queues never fill up with duplicate requests and stale answers
+	bitset<numeric_limits<TIndexInNetwork>::max() + 1> pending_reads;
+
+	const TCompiledInstructionDispatch* compiled_instructions{};
+	VMExecutionTier execution_tier = VMExecutionTier::Interpreted;
+
+	// only allocated for runs started with profiling on, so counting costs a null check otherwise
+	bool profiling{};
+	unique_ptr<VMProfile> profile;
+
+	// loop detection, Brent's cycle finding on the run state after each backward jump: probes compare it with the state
+	// saved at the last probe, saved again at doubling distances, none while the activity keeps changing; when one matches,
+	// the next lap is recorded as the run state and failed sends before each step, and the VM goes around it until the
+	// activity changes, parked instead of stepping when allowed, see Step
+	struct LoopStep
+	{
+		DeviceRunState state;
+		uint64_t failed_sends;
+	};
+	static constexpr size_t MaxLoopLength = 256;
+	bool detect_loops{}, parking_allowed{}, recording_loop{}, looping{}, parked{};
+	DeviceRunState loop_probe;
+	size_t probe_distance{}, probe_limit{};
+	uint64_t probe_activity{};
+	vector<LoopStep> loop;
+	size_t loop_length{}, loop_phase{};
+	uint64_t loop_activity{}, lap_failed_sends{};
+
+	bool SameRunState(const DeviceRunState& state) const;
+	void ProbeLoop();
 
 	bool ExecuteNextInstruction() override;
+	void OnMemoryWritten(size_t begin, size_t end) override;
+	void OnMemoryRestored() override { InvalidateDecodedInstructions(); }
+	void InvalidateDecodedInstructions();
+
+	void SaveRunState(DeviceRunState& state) const override;
+	void LoadRunState(const DeviceRunState& state) override;
 
 public:
-	VM(int registers, size_t memory_size, const vector<VMInstruction>& instructions = {})
-		: BaseMemory(memory_size, false)
+	VM(int registers, size_t memory_size, shared_ptr<const VMInstructionTable> instructions,
+		const TCompiledInstructionDispatch* compiled_instructions = nullptr)
+		: BaseMemory(memory_size, false), decoded_instructions(memory.PageCount()), translated_blocks(memory.PageCount()), compiled_instructions(compiled_instructions)
 	{
 		this->registers = vector<TRegister>(registers);
-		for (auto&& instruction : instructions)
-			this->instructions.insert({ IndexFromOpcode(instruction.base_opcode), instruction });
+		this->instructions = move(instructions);
+
+		// the address width comes from the instruction set, and the memory has to fit in it
+		address_bytes = this->instructions->AddressBytes();
+		address_mask = address_bytes >= sizeof(TAddress) ? numeric_limits<TAddress>::max() : (TAddress(1) << address_bytes * 8) - 1;
+		assert(memory_size - 1 <= address_mask);
 	}
 
+	// the compiled tier is only available to machines built from a CompiledInstructionSet, the native tier only on hosts
+	// that can run the generated code; the interpreted and translated tiers run on any machine
+	auto ExecutionTier() const { return execution_tier; }
+	void ExecutionTier(VMExecutionTier value)
+	{
+		if (value == VMExecutionTier::Compiled && !compiled_instructions)
+			value = VMExecutionTier::Interpreted;
+		if (value == VMExecutionTier::Native && !NativeTierAvailable())
+			value = VMExecutionTier::Translated;
+		execution_tier = value;
+	}
+	static bool NativeTierAvailable();
+
 	const auto Register(int index) const { return registers[index]; }
-	void Register(int index, const TRegister value) { registers[index] = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void Register(int index, const TRegister value) { registers[index] = value; pending_changes.registers |= 1u << index; }
 
 	const auto RegisterCount() const { return registers.size(); }
 
 	const auto FlagZero() const { return flags.zero; }
-	void FlagZero(bool value) { flags.zero = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void FlagZero(bool value) { flags.zero = value; pending_changes.flags = true; }
+
+	bool ReadPending(TIndexInNetwork index_in_network) const { return pending_reads[index_in_network]; }
+	void ReadPending(TIndexInNetwork index_in_network, bool value) { pending_reads[index_in_network] = value; }
+	// never parks while profiling, which counts every step
+	void DetectLoops(bool detect, bool park) override { detect_loops = detect; parking_allowed = detect && park; }
+	size_t LoopLength() const override { return looping && Activity() == loop_activity ? loop_length : 0; }
+	bool Parked() const override { return parked; }
+	void Resume(size_t parked_steps) override;
+
+	// counts what the program does from the next run on, so a running program never sees the counters come or go
+	bool Profiling() const { return profiling; }
+	void Profiling(bool value) { profiling = value; }
+	// the current run's counts, null unless it started with profiling on
+	const VMProfile* Profile() const { return profile.get(); }
+	VMProfile* Profile() { return profile.get(); }
+
+	// the program's own memory accesses, which the profiler counts
+	TMemory DataMemory(size_t index) { if (profile) profile->CountRead(index); return Memory(index); }
+	bool DataMemory(size_t index, TMemory value) { if (profile) profile->CountWrite(index); return Memory(index, value); }
 
 	const auto IP() const { return ip; }
-	void IP(const TRegister value) { ip = value; GlobalEventQueue.enqueue(GlobalEventType::VMDirty, this); }
+	void IP(const TAddress value) { ip = value & address_mask; pending_changes.ip = true; }
+	// continues at target instead of the next instruction
+	void Jump(const TAddress target) { IP(target); jumped = true; }
 
 	void SetupForRun() override;
 	void Step() override;
+	// only the translated and native tiers run blocks back to back, the others leave it to Step
+	size_t StepAlone(size_t max_steps) override;
+	void Stop() override;
 };
 
 export class RAM : public BaseMemory
@@ -178,6 +757,14 @@ public:
 	}
 
 	void Step() override;
+	bool Passive() const override { return true; }
+};
+
+// display cells are three bytes: character, foreground and background colors from this palette
+export enum class DisplayColor : TMemory
+{
+	Black, Red, Green, Yellow, Blue, Magenta, Cyan, GrayLight,
+	GrayDark, RedLight, GreenLight, YellowLight, BlueLight, MagentaLight, CyanLight, White,
 };
 
 export class Display : public BaseMemory
@@ -191,14 +778,46 @@ public:
 		: BaseMemory(width* height * 3, true), width(width), height(height)
 	{
 		// set the memory to white on black
-		for (size_t i = 0; i < memory.size(); i += 3)
-			memory[i + 1] = 15;
+		for (size_t i = 0; i < memory.Size(); i += 3)
+			memory.Write(i + 1, static_cast<TMemory>(DisplayColor::White));
 	}
 
 	auto Width() const { return width; }
 	auto Height() const { return height; }
 
 	void Step() override;
+	bool Passive() const override { return true; }
+};
+
+// what a block transfer ended with, sent back to its requester
+export enum class DMAStatus : TRegister
+{
+	Done,
+	NoSuchDevice,
+	OutOfBounds,
+};
+
+// copies blocks of memory between the devices of its network. A requester sends it the address of a transfer descriptor
+// in its own memory as a read request; the block is copied in one go when the request is delivered, and the answer is
+// the DMAStatus, which the requester receives on the next tick. Writes to it are ignored.
+export class DMA : public BaseMemory
+{
+	vector<TMemory> transfer_buffer;
+
+	bool ExecuteNextInstruction() override;
+	DMAStatus Transfer(const BaseMemory& requester, size_t descriptor_address);
+
+public:
+	// source device, source address, destination device, destination address and length, little endian
+	static constexpr size_t DescriptorSize = 8;
+
+	DMA()
+		: BaseMemory(0, false)
+	{
+	}
+
+	void Step() override;
+	bool Passive() const override { return true; }
 };
 
 export VMInstruction MakeLoadRegister0AddressInstruction(initializer_list<uint8_t> opcode);
@@ -216,4 +835,5 @@ export VMInstruction MakeJmpNotZeroImm8Instruction(initializer_list<uint8_t> opc
 export VMInstruction MakeOutImm8Instruction(initializer_list<uint8_t> opcode);
 export VMInstruction MakeInInstruction(initializer_list<uint8_t> opcode);
 export VMInstruction MakeTestZeroInstruction(initializer_list<uint8_t> opcode);
-export VMInstruction MakeTestGreaterThanImm8Instruction(initializer_list<uint8_t> opcode);
\ No newline at end of file
+export VMInstruction MakeTestGreaterThanImm8Instruction(initializer_list<uint8_t> opcode);
+export VMInstruction MakeXferInstruction(initializer_list<uint8_t> opcode);
\ No newline at end of file
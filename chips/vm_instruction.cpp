@@ -1,12 +1,23 @@
 #include "stdafx.h"
 
-import std.core;
+import std;
 import vm;
 
 using namespace std;
 
-VMInstruction::VMInstruction(const char* name, const vector<TMemory> base_opcode, const vector<TOperand> operands, const char* base_description_markup, function<bool(const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values)> execute_internal)
-	: name(name), base_opcode(base_opcode), operands(operands), execute_internal(execute_internal)
+static size_t ComputeOpcodeLength(const vector<TMemory>& base_opcode, const vector<VMInstruction::TOperand>& operands, size_t address_bytes)
+{
+	size_t length = base_opcode.size();
+	for (auto&& operand : operands)
+		visit([&](auto&& v) { length += OperandByteSize<remove_cvref_t<decltype(v)>>(address_bytes); }, operand);
+
+	return length;
+}
+
+VMInstruction::VMInstruction(const char* name, const vector<TMemory> base_opcode, const vector<TOperand> operands, const char* base_description_markup, function<bool(const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values)> execute_internal,
+	size_t address_bytes)
+	: name(name), base_opcode(base_opcode), operands(operands), address_bytes(address_bytes),
+	opcode_length(ComputeOpcodeLength(base_opcode, operands, address_bytes)), execute_internal(execute_internal)
 {
 	// convert the base opcode to a string
 	string opcode_string;
@@ -14,7 +25,7 @@ VMInstruction::VMInstruction(const char* name, const vector<TMemory> base_opcode
 		opcode_string += format("{:02x} ", opcode);
 
 	// add the instruction definition to the description markup
-	string description_markup = format("`{}{}` ", opcode_string, name);
+	description_markup = format("`{}{}` ", opcode_string, name);
 
 	int idx = 0;
 	for (auto&& operand : operands)
@@ -33,37 +44,41 @@ VMInstruction::VMInstruction(const char* name, const vector<TMemory> base_opcode
 		++idx;
 	}
 
-	description_element = BuildMarkupElement(description_markup + "\n" + base_description_markup);
+	description_markup += "\n";
+	description_markup += base_description_markup;
 }
 
-size_t VMInstruction::OpcodeLength() const
+bool VMInstruction::DecodeOperands(const span<const TMemory> memory, size_t memory_index, vector<size_t>& operand_values) const
 {
-	size_t length = base_opcode.size();
-	for (auto&& operand : operands)
-		visit([&](auto&& v) { length += remove_cvref_t<decltype(v)>::ByteSize; }, operand);
-
-	return length;
-}
+	if (memory_index + OpcodeLength() > memory.size())
+		return false;
 
-bool VMInstruction::Execute(VM& vm, size_t memory_index) const
-{
-	auto instruction_stream = vm.Memory({ memory_index, OpcodeLength() });
+	auto instruction_stream = memory.subspan(memory_index, OpcodeLength());
 	if (!OpcodeValid(instruction_stream))
 		return false;
 
 	instruction_stream = instruction_stream.subspan(base_opcode.size());
-	vector<size_t> operand_values;
+	operand_values.clear();
 	operand_values.reserve(operands.size());
 	for (auto&& operand : operands)
 	{
 		visit(overload{
 			[&](const Imm<1>&) { operand_values.push_back(instruction_stream[0]); instruction_stream = instruction_stream.subspan(1); },
-			[&](const Imm<2>&) { operand_values.push_back(*reinterpret_cast<const uint16_t*>(instruction_stream.subspan(0, 2).data())); instruction_stream = instruction_stream.subspan(2); },
-			[&](const Imm<4>&) { operand_values.push_back(*reinterpret_cast<const uint32_t*>(instruction_stream.subspan(0, 4).data())); instruction_stream = instruction_stream.subspan(4); },
-			[&](const Addr&) { operand_values.push_back(*reinterpret_cast<const TAddress*>(instruction_stream.subspan(0, sizeof(TAddress)).data())); instruction_stream = instruction_stream.subspan(sizeof(TAddress)); },
+			[&](const Imm<2>&) { operand_values.push_back(ReadLittleEndian(instruction_stream.data(), 2)); instruction_stream = instruction_stream.subspan(2); },
+			[&](const Imm<4>&) { operand_values.push_back(ReadLittleEndian(instruction_stream.data(), 4)); instruction_stream = instruction_stream.subspan(4); },
+			[&](const Addr&) { operand_values.push_back(ReadLittleEndian(instruction_stream.data(), address_bytes)); instruction_stream = instruction_stream.subspan(address_bytes); },
 			[&](const Reg&) { operand_values.push_back(instruction_stream[0]); instruction_stream = instruction_stream.subspan(1); },
 			}, operand);
 	}
+	return true;
+}
+
+bool VMInstruction::Execute(VM& vm, size_t memory_index) const
+{
+	array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+	vector<size_t> operand_values;
+	if (!DecodeOperands(vm.Memory(memory_index, span{ buffer }.first(OpcodeLength())), 0, operand_values))
+		return false;
 
 	if (!execute_internal || !execute_internal(*this, vm, memory_index, operand_values))
 		return false;
@@ -72,10 +87,8 @@ bool VMInstruction::Execute(VM& vm, size_t memory_index) const
 
 optional<string> VMInstruction::Decode(const BaseMemory* memory, size_t memory_index) const
 {
-	if (memory_index + OpcodeLength() > memory->MemorySize())
-		return nullopt;
-
-	auto instruction_stream = memory->Memory({ memory_index, OpcodeLength() });
+	array<TMemory, VMInstructionTable::MaxInstructionBytes> buffer;
+	auto instruction_stream = memory->Memory(memory_index, span{ buffer }.first(OpcodeLength()));
 	if (!OpcodeValid(instruction_stream))
 		return nullopt;
 	instruction_stream = instruction_stream.subspan(base_opcode.size());
@@ -92,19 +105,12 @@ optional<string> VMInstruction::Decode(const BaseMemory* memory, size_t memory_i
 
 		visit(overload{
 			[&](const Imm<1>&) { result += format("{:#04x}", instruction_stream[0]); instruction_stream = instruction_stream.subspan(1); },
-			[&](const Imm<2>&) { result += format("{:#06x}", *reinterpret_cast<const uint16_t*>(instruction_stream.subspan(0, 2).data())); instruction_stream = instruction_stream.subspan(2); },
-			[&](const Imm<4>&) { result += format("{:#010x}", *reinterpret_cast<const uint32_t*>(instruction_stream.subspan(0, 4).data())); instruction_stream = instruction_stream.subspan(4); },
+			[&](const Imm<2>&) { result += format("{:#06x}", ReadLittleEndian(instruction_stream.data(), 2)); instruction_stream = instruction_stream.subspan(2); },
+			[&](const Imm<4>&) { result += format("{:#010x}", ReadLittleEndian(instruction_stream.data(), 4)); instruction_stream = instruction_stream.subspan(4); },
 			[&](const Addr&) {
-				auto address = *reinterpret_cast<const TAddress*>(instruction_stream.subspan(0, sizeof(TAddress)).data());
-				if (sizeof(TAddress) == 4)
-					result += format("[{:#010x}]", static_cast<intptr_t>(address));
-				else if (sizeof(TAddress) == 2)
-					result += format("[{:#06x}]", static_cast<intptr_t>(address));
-				else if (sizeof(TAddress) == 1)
-					result += format("[{:#04x}]", static_cast<intptr_t>(address));
-				else
-					assert(false);
-				instruction_stream = instruction_stream.subspan(sizeof(TAddress));
+				// as many digits as the address width
+				result += format("[{:#0{}x}]", ReadLittleEndian(instruction_stream.data(), address_bytes), 2 + address_bytes * 2);
+				instruction_stream = instruction_stream.subspan(address_bytes);
 			},
 			[&](const Reg&) { result += memory->RegisterName(instruction_stream[0]); instruction_stream = instruction_stream.subspan(1); },
 			}, operand);
@@ -0,0 +1,450 @@
+module;
+
+#include "stdafx.h"
+
+export module vm_instruction_set;
+
+import std;
+import vm;
+
+using namespace std;
+
+// instruction semantics, one type per instruction, shared by the runtime VMInstruction path and compiled instruction sets
+
+export struct LoadRegister0Address
+{
+	static constexpr const char* name = "LDR0";
+	static constexpr const char* description_markup = "Loads the value at `addr0` into `R0`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+
+		vm.Register(0, vm.DataMemory(address));
+		return true;
+	}
+};
+
+export struct LoadRegister1Address
+{
+	static constexpr const char* name = "LDR1";
+	static constexpr const char* description_markup = "Loads the value at `addr0` into `R1`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 2) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+
+		vm.Register(1, vm.DataMemory(address));
+		return true;
+	}
+};
+
+export struct LoadRegister0Imm8
+{
+	static constexpr const char* name = "LDR0I8";
+	static constexpr const char* description_markup = "Loads the immediate value `i8val0` into `R0`.";
+	using TOperands = tuple<Imm<1>>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		vm.Register(0, static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct LoadRegister1Imm8
+{
+	static constexpr const char* name = "LDR1I8";
+	static constexpr const char* description_markup = "Loads the immediate value `i8val0` into `R1`.";
+	using TOperands = tuple<Imm<1>>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 2) return false;
+		vm.Register(1, static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct StoreRegister0Address
+{
+	static constexpr const char* name = "STR0";
+	static constexpr const char* description_markup = "Stores the value in `R0` at `addr0`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+
+		vm.DataMemory(address, vm.Register(0));
+		return true;
+	}
+};
+
+export struct StoreRegister1Address
+{
+	static constexpr const char* name = "STR1";
+	static constexpr const char* description_markup = "Stores the value in `R1` at `addr0`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 2) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+
+		vm.DataMemory(address, vm.Register(1));
+		return true;
+	}
+};
+
+export struct AddRegister0Imm8
+{
+	static constexpr const char* name = "ADDI8";
+	static constexpr const char* description_markup = "Adds the immediate value `i8val0` to `R0`.";
+	using TOperands = tuple<Imm<1>>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		vm.Register(0, vm.Register(0) + static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct AddRegister0Address
+{
+	static constexpr const char* name = "ADD";
+	static constexpr const char* description_markup = "Adds the value at `addr0` to `R0`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+		vm.Register(0, vm.Register(0) + vm.DataMemory(address));
+		return true;
+	}
+};
+
+export struct SubRegister0Imm8
+{
+	static constexpr const char* name = "SUBI8";
+	static constexpr const char* description_markup = "Subtracts the immediate value `i8val0` from `R0`.";
+	using TOperands = tuple<Imm<1>>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		vm.Register(0, vm.Register(0) - static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct SubRegister0Address
+{
+	static constexpr const char* name = "SUB";
+	static constexpr const char* description_markup = "Subtracts the value at `addr0` from `R0`.";
+	using TOperands = tuple<Addr>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		const auto address = operand_values[0];
+		if (address >= vm.MemorySize()) return false;
+		vm.Register(0, vm.Register(0) - vm.DataMemory(address));
+		return true;
+	}
+};
+
+export struct JmpImm8
+{
+	static constexpr const char* name = "JMPI8";
+	static constexpr const char* description_markup = "Jumps to the immediate value `i8val0`.";
+	using TOperands = tuple<Imm<1>>;
+	static constexpr bool ends_block = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		vm.Jump(static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct JmpNotZeroImm8
+{
+	static constexpr const char* name = "JMPNZI8";
+	static constexpr const char* description_markup = "Jumps to the immediate value `i8val0` if the zero flag is not set.";
+	using TOperands = tuple<Imm<1>>;
+	static constexpr bool ends_block = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (!vm.FlagZero())
+			vm.Jump(static_cast<TRegister>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct JmpAddress
+{
+	static constexpr const char* name = "JMP";
+	static constexpr const char* description_markup = "Jumps to `addr0`.";
+	using TOperands = tuple<Addr>;
+	static constexpr bool ends_block = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		vm.Jump(static_cast<TAddress>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct JmpNotZeroAddress
+{
+	static constexpr const char* name = "JMPNZ";
+	static constexpr const char* description_markup = "Jumps to `addr0` if the zero flag is not set.";
+	using TOperands = tuple<Addr>;
+	static constexpr bool ends_block = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (!vm.FlagZero())
+			vm.Jump(static_cast<TAddress>(operand_values[0]));
+		return true;
+	}
+};
+
+export struct OutImm8
+{
+	static constexpr const char* name = "OUTI8";
+	static constexpr const char* description_markup = "Send the value `i8val0` to network device at `R0` and address `R1`.\nSets the zero flag in case of error or buffer full.";
+	using TOperands = tuple<Imm<1>>;
+	static constexpr bool ends_block = true;
+	static constexpr bool network = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 2) return false;
+
+		const auto dst_index = vm.Register(0);
+		const auto address = vm.Register(1);
+		const auto value = static_cast<TRegister>(operand_values[0]);
+
+		const auto sent = vm.SendData(dst_index, { address, value });
+		vm.FlagZero(!sent);
+		if (auto profile = vm.Profile(); profile && !sent)
+			++profile->out_failures;
+		return true;
+	}
+};
+
+export struct In
+{
+	static constexpr const char* name = "IN";
+	static constexpr const char* description_markup = "Requests a value from the network device at index `R0` and address `R1`.\nEither sets the zero flag if no data received,\nor data is received in `R0` and zero flag is cleared.";
+	using TOperands = tuple<>;
+	static constexpr bool ends_block = true;
+	static constexpr bool network = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 2) return false;
+
+		const auto src_index = vm.Register(0);
+		const auto value = vm.IncomingData(src_index);
+		if (!value)
+		{
+			vm.FlagZero(true);
+			if (auto profile = vm.Profile())
+				++profile->in_stalls;
+
+			// send the request, unless the previous one is still unanswered
+			if (!vm.ReadPending(src_index) && vm.SendData(src_index, { vm.Register(1), nullopt }))
+				vm.ReadPending(src_index, true);
+		}
+		else
+		{
+			// a read request, from a device reading from us, carries no value
+			vm.FlagZero(false);
+			vm.Register(0, get<1>(*value).value_or(0));
+			vm.ConsumeIncomingData(src_index);
+			vm.ReadPending(src_index, false);
+		}
+
+		return true;
+	}
+};
+
+export struct Xfer
+{
+	static constexpr const char* name = "XFER";
+	static constexpr const char* description_markup = "Asks the DMA device at index `R0` for the block transfer described at `addr0`: source device, source address, destination device, destination address and length, the addresses and length 16-bit little endian.\nEither sets the zero flag while it is not done yet,\nor the status is received in `R0` (0 when the block was copied) and zero flag is cleared.";
+	using TOperands = tuple<Addr>;
+	static constexpr bool ends_block = true;
+	static constexpr bool network = true;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+
+		const auto dma_index = vm.Register(0);
+		const auto status = vm.IncomingData(dma_index);
+		if (!status)
+		{
+			vm.FlagZero(true);
+			if (auto profile = vm.Profile())
+				++profile->xfer_stalls;
+
+			// send the request, unless it is still running
+			if (!vm.ReadPending(dma_index) && vm.SendData(dma_index, { static_cast<TAddress>(operand_values[0]), nullopt }))
+				vm.ReadPending(dma_index, true);
+		}
+		else
+		{
+			vm.FlagZero(false);
+			vm.Register(0, get<1>(*status).value_or(0));
+			vm.ConsumeIncomingData(dma_index);
+			vm.ReadPending(dma_index, false);
+		}
+
+		return true;
+	}
+};
+
+export struct TestZero
+{
+	static constexpr const char* name = "TESTZ";
+	static constexpr const char* description_markup = "Sets the zero flag if `R0` is zero.";
+	using TOperands = tuple<>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		vm.FlagZero(vm.Register(0) == 0);
+		return true;
+	}
+};
+
+export struct TestGreaterThanImm8
+{
+	static constexpr const char* name = "TESTGT";
+	static constexpr const char* description_markup = "Sets the zero flag if `R0` is greater than `i8val0`.";
+	using TOperands = tuple<Imm<1>>;
+
+	static bool Execute(VM& vm, size_t memory_index, span<const size_t> operand_values)
+	{
+		if (vm.RegisterCount() < 1) return false;
+		vm.FlagZero(vm.Register(0) > operand_values[0]);
+		return true;
+	}
+};
+
+template<typename... TOperand>
+vector<VMInstruction::TOperand> MakeOperandList(type_identity<tuple<TOperand...>>)
+{
+	return { TOperand{}... };
+}
+
+// builds the runtime (documented, decodable) form of an instruction from its semantics
+export template<typename TSemantics>
+VMInstruction MakeInstruction(initializer_list<TMemory> opcode, size_t address_bytes = 1)
+{
+	VMInstruction instruction{ TSemantics::name, vector<TMemory>{ opcode }, MakeOperandList(type_identity<typename TSemantics::TOperands>{}),
+		TSemantics::description_markup,
+		[](const VMInstruction& self, VM& vm, size_t memory_index, const vector<size_t>& operand_values) -> bool
+		{
+			return TSemantics::Execute(vm, memory_index, operand_values);
+		},
+		address_bytes
+	};
+	instruction.semantics = &TSemantics::Execute;
+	if constexpr (requires { TSemantics::ends_block; })
+		instruction.ends_block = TSemantics::ends_block;
+	if constexpr (requires { TSemantics::network; })
+		instruction.network = TSemantics::network;
+	return instruction;
+}
+
+// an instruction bound to its opcode at compile time, with a constexpr layout per address width and an inlined handler
+export template<typename TSemantics, TMemory... Opcode>
+struct CompiledInstruction
+{
+	using TOperands = typename TSemantics::TOperands;
+
+	static constexpr array<TMemory, sizeof...(Opcode)> opcode{ Opcode... };
+	static constexpr size_t operand_count = tuple_size_v<TOperands>;
+	template<size_t AddressBytes>
+	static constexpr array<size_t, operand_count + 1> operand_offsets = []<typename... TOperand>(type_identity<tuple<TOperand...>>)
+		{
+			array<size_t, operand_count + 1> offsets{ sizeof...(Opcode) };
+			size_t index = 0;
+			((offsets[index + 1] = offsets[index] + OperandByteSize<TOperand>(AddressBytes), ++index), ...);
+			return offsets;
+		}(type_identity<TOperands>{});
+	template<size_t AddressBytes>
+	static constexpr size_t length = operand_offsets<AddressBytes>.back();
+
+	static VMInstruction MakeInstruction(size_t address_bytes) { return ::MakeInstruction<TSemantics>({ Opcode... }, address_bytes); }
+
+	// returns the instruction length, or 0 if the instruction could not be executed
+	template<size_t AddressBytes>
+	static size_t Execute(VM& vm, size_t memory_index)
+	{
+		array<TMemory, length<AddressBytes>> buffer;
+		const auto stream = vm.Memory(memory_index, buffer);
+		if (stream.size() < length<AddressBytes>)
+			return 0;
+
+		for (size_t i = 1; i < opcode.size(); ++i)
+			if (stream[i] != opcode[i])
+				return 0;
+
+		const auto operand_values = [&]<size_t... Index>(index_sequence<Index...>)
+			{
+				return array<size_t, operand_count>{ ReadLittleEndian(stream.data() + operand_offsets<AddressBytes>[Index],
+					OperandByteSize<tuple_element_t<Index, TOperands>>(AddressBytes))... };
+			}(make_index_sequence<operand_count>{});
+
+		return TSemantics::Execute(vm, memory_index, operand_values) ? length<AddressBytes> : 0;
+	}
+};
+
+// a compile-time instruction set for machines with AddressBytes wide addresses: a type list of CompiledInstruction,
+// dispatched through a constexpr table on the first opcode byte
+export template<size_t AddressBytes, typename... TInstructions>
+struct CompiledInstructionSet
+{
+	static_assert([]
+		{
+			array<bool, 256> used{};
+			for (auto first_byte : { TInstructions::opcode[0]... })
+			{
+				if (used[first_byte])
+					return false;
+				used[first_byte] = true;
+			}
+			return true;
+		}(), "Compiled instruction sets need a distinct first opcode byte per instruction.");
+
+	static constexpr size_t max_instruction_length = max({ TInstructions::template length<AddressBytes>... });
+
+	static constexpr TCompiledInstructionDispatch dispatch = []
+		{
+			TCompiledInstructionDispatch dispatch{};
+			((dispatch[TInstructions::opcode[0]] = &TInstructions::template Execute<AddressBytes>), ...);
+			return dispatch;
+		}();
+
+	static vector<VMInstruction> Instructions() { return { TInstructions::MakeInstruction(AddressBytes)... }; }
+};
@@ -0,0 +1,36 @@
+#include "stdafx.h"
+
+import std;
+import vm;
+
+using namespace std;
+
+VMInstructionTable::VMInstructionTable(const vector<VMInstruction>& instructions)
+	: instructions(instructions)
+{
+	for (size_t index = 0; index < this->instructions.size(); ++index)
+	{
+		const auto& opcode = this->instructions[index].base_opcode;
+		assert(!opcode.empty());
+
+		// walk (and grow) the prefix nodes for every opcode byte but the last
+		uint16_t node = 0;
+		for (size_t i = 0; i + 1 < opcode.size(); ++i)
+		{
+			assert(!nodes[node].instruction[opcode[i]]);
+			if (!nodes[node].prefix[opcode[i]])
+			{
+				nodes[node].prefix[opcode[i]] = static_cast<uint16_t>(nodes.size());
+				nodes.emplace_back();
+			}
+			node = nodes[node].prefix[opcode[i]];
+		}
+
+		assert(!nodes[node].instruction[opcode.back()] && !nodes[node].prefix[opcode.back()]);
+		nodes[node].instruction[opcode.back()] = static_cast<uint16_t>(index + 1);
+		max_instruction_length = max(max_instruction_length, this->instructions[index].OpcodeLength());
+		assert(max_instruction_length <= MaxInstructionBytes);
+		assert(!index || this->instructions[index].address_bytes == address_bytes);
+		address_bytes = this->instructions[index].address_bytes;
+	}
+}
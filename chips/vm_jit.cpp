@@ -0,0 +1,298 @@
+#include "stdafx.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CHIPS_NATIVE_TIER
+#include <sys/mman.h>
+#endif
+
+import std;
+import vm;
+import vm_instruction_set;
+
+using namespace std;
+
+// the native tier compiles the leading instructions of a translated block into one function, with an entry point per
+// instruction. While it runs, rbx holds the NativeState, r12 the remaining budget, r13b R0, r14b R1 and r15b the zero flag;
+// it leaves through the shared epilogue, which stores them back, after the budget runs out, after a jump, after a write
+// to translated or watched memory and before the first instruction it can't run, which the translated tier then runs
+// instead. Only a VM stepping alone runs it, with a budget of the ticks it may go through, see VM::StepAlone
+namespace
+{
+	class X64Assembler
+	{
+		vector<TMemory> code;
+
+	public:
+		const auto& Code() const { return code; }
+		auto Position() const { return static_cast<uint32_t>(code.size()); }
+
+		void Emit(initializer_list<TMemory> bytes) { code.insert(code.end(), bytes); }
+		void Emit32(uint32_t value)
+		{
+			for (int i = 0; i < 4; ++i)
+				code.push_back(static_cast<TMemory>(value >> i * 8));
+		}
+		void Emit64(uint64_t value)
+		{
+			Emit32(static_cast<uint32_t>(value));
+			Emit32(static_cast<uint32_t>(value >> 32));
+		}
+
+		// jmp rel32 to code emitted before
+		void Jump(uint32_t target)
+		{
+			Emit({ 0xE9 });
+			Emit32(target - (Position() + 4));
+		}
+
+		// mov rdi, rbx; mov esi, address; ...; mov rax, function; call rax
+		template<typename TFunction>
+		void Call(TFunction function, size_t address, initializer_list<TMemory> load_third_argument = {})
+		{
+			Emit({ 0x48, 0x89, 0xDF, 0xBE });
+			Emit32(static_cast<uint32_t>(address));
+			Emit(load_third_argument);
+			Emit({ 0x48, 0xB8 });
+			Emit64(reinterpret_cast<uint64_t>(function));
+			Emit({ 0xFF, 0xD0 });
+		}
+	};
+}
+
+VM::NativeCode::~NativeCode()
+{
+#ifdef CHIPS_NATIVE_TIER
+	if (code)
+		munmap(code, code_size);
+#endif
+}
+
+bool VM::NativeTierAvailable()
+{
+#ifdef CHIPS_NATIVE_TIER
+	// some hosts refuse executable mappings altogether
+	static const bool available = []
+		{
+			const auto page = mmap(nullptr, 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (page == MAP_FAILED)
+				return false;
+			const auto executable = mprotect(page, 1, PROT_READ | PROT_EXEC) == 0;
+			munmap(page, 1);
+			return executable;
+		}();
+	return available;
+#else
+	return false;
+#endif
+}
+
+TMemory VM::NativeLoad(NativeState* state, size_t address)
+{
+	return state->vm->DataMemory(address);
+}
+
+bool VM::NativeStore(NativeState* state, size_t address, TMemory value)
+{
+	// the native code might be running the block this overwrites, so it leaves right after the write, as it does after
+	// a write to a watched byte so the checks see it before anything else runs
+	auto& vm = *state->vm;
+	const auto translated = !vm.translated_memory.empty() && vm.translated_memory[address];
+	vm.DataMemory(address, value);
+	return translated || vm.watched_memory_changed;
+}
+
+void VM::CompileNativeCode(TranslatedBlock& block) const
+{
+	if (!NativeTierAvailable() || registers.size() < 2)
+		return;
+
+	// shared by every VM, since validation runs the same program on a fresh instance per seed and mapping code is slow
+	// next to translating it; the same bytes at the same address of the same machine with the same instruction set
+	// compile to the same code. Clearing it only drops the cache's references, the blocks keep theirs
+	static constexpr size_t MaxCachedNativeCode = 4096;
+	static mutex cache_mutex;
+	using TCacheKey = tuple<const VMInstructionTable*, size_t, TAddress, size_t, vector<TMemory>>;
+	static map<TCacheKey, shared_ptr<const NativeCode>> cache;
+
+	TCacheKey key{ instructions.get(), block.begin, address_mask, memory.Size(), vector<TMemory>(block.end - block.begin) };
+	auto& source = get<4>(key);
+	if (const auto bytes = memory.Read(block.begin, source); bytes.data() != source.data())
+		ranges::copy(bytes, source.begin());
+	{
+		lock_guard lock(cache_mutex);
+		if (auto it = cache.find(key); it != cache.end())
+		{
+			block.native = it->second;
+			return;
+		}
+	}
+
+	X64Assembler assembler;
+
+	// prologue: push rbx, r12-r15; mov rbx, rdi; load the budget, the registers and the flag; jmp rsi
+	assembler.Emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x89, 0xFB });
+	assembler.Emit({ 0x4C, 0x8B, 0x63, static_cast<TMemory>(offsetof(NativeState, budget)) });
+	assembler.Emit({ 0x44, 0x0F, 0xB6, 0x6B, static_cast<TMemory>(offsetof(NativeState, registers)) });
+	assembler.Emit({ 0x44, 0x0F, 0xB6, 0x73, static_cast<TMemory>(offsetof(NativeState, registers) + 1) });
+	assembler.Emit({ 0x44, 0x0F, 0xB6, 0x7B, static_cast<TMemory>(offsetof(NativeState, zero)) });
+	assembler.Emit({ 0xFF, 0xE6 });
+
+	// epilogue: store them back; pop r15-r12, rbx; ret
+	const auto epilogue = assembler.Position();
+	assembler.Emit({ 0x4C, 0x89, 0x63, static_cast<TMemory>(offsetof(NativeState, budget)) });
+	assembler.Emit({ 0x44, 0x88, 0x6B, static_cast<TMemory>(offsetof(NativeState, registers)) });
+	assembler.Emit({ 0x44, 0x88, 0x73, static_cast<TMemory>(offsetof(NativeState, registers) + 1) });
+	assembler.Emit({ 0x44, 0x88, 0x7B, static_cast<TMemory>(offsetof(NativeState, zero)) });
+	assembler.Emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+
+	// mov dword [rbx + ip], next; jmp epilogue, 12 bytes
+	const auto leave = [&](TAddress next)
+		{
+			assembler.Emit({ 0xC7, 0x43, static_cast<TMemory>(offsetof(NativeState, ip)) });
+			assembler.Emit32(next);
+			assembler.Jump(epilogue);
+		};
+
+	vector<uint32_t> entries;
+	TAddress next{};
+	bool jumped = false;
+	for (auto& instruction : block.instructions)
+	{
+		const auto semantics = instruction.semantics;
+		const auto operand = instruction.operand_values.empty() ? 0 : instruction.operand_values[0];
+		const auto in_memory = operand < memory.Size();
+		const auto entry = assembler.Position();
+		next = static_cast<TAddress>(instruction.address + instruction.length) & address_mask;
+
+		// dec r12, then the instruction is done
+		const auto count = [&] { assembler.Emit({ 0x49, 0xFF, 0xCC }); };
+		// leave once the budget ran out: jnz +12 over leaving
+		const auto count_and_continue = [&] { count(); assembler.Emit({ 0x75, 0x0C }); leave(next); };
+
+		if (semantics == &LoadRegister0Imm8::Execute)
+			assembler.Emit({ 0x41, 0xB5, static_cast<TMemory>(operand) });						// mov r13b, imm8
+		else if (semantics == &LoadRegister1Imm8::Execute)
+			assembler.Emit({ 0x41, 0xB6, static_cast<TMemory>(operand) });						// mov r14b, imm8
+		else if (semantics == &AddRegister0Imm8::Execute)
+			assembler.Emit({ 0x41, 0x80, 0xC5, static_cast<TMemory>(operand) });				// add r13b, imm8
+		else if (semantics == &SubRegister0Imm8::Execute)
+			assembler.Emit({ 0x41, 0x80, 0xED, static_cast<TMemory>(operand) });				// sub r13b, imm8
+		else if (semantics == &TestZero::Execute)
+			assembler.Emit({ 0x45, 0x84, 0xED, 0x41, 0x0F, 0x94, 0xC7 });						// test r13b, r13b; sete r15b
+		else if (semantics == &TestGreaterThanImm8::Execute)
+			assembler.Emit({ 0x41, 0x80, 0xFD, static_cast<TMemory>(operand), 0x41, 0x0F, 0x97, 0xC7 });	// cmp r13b, imm8; seta r15b
+		else if (in_memory && semantics == &LoadRegister0Address::Execute)
+		{
+			assembler.Call(&NativeLoad, operand);
+			assembler.Emit({ 0x41, 0x88, 0xC5 });											// mov r13b, al
+		}
+		else if (in_memory && semantics == &LoadRegister1Address::Execute)
+		{
+			assembler.Call(&NativeLoad, operand);
+			assembler.Emit({ 0x41, 0x88, 0xC6 });											// mov r14b, al
+		}
+		else if (in_memory && semantics == &AddRegister0Address::Execute)
+		{
+			assembler.Call(&NativeLoad, operand);
+			assembler.Emit({ 0x41, 0x00, 0xC5 });											// add r13b, al
+		}
+		else if (in_memory && semantics == &SubRegister0Address::Execute)
+		{
+			assembler.Call(&NativeLoad, operand);
+			assembler.Emit({ 0x41, 0x28, 0xC5 });											// sub r13b, al
+		}
+		else if (in_memory && (semantics == &StoreRegister0Address::Execute || semantics == &StoreRegister1Address::Execute))
+		{
+			// movzx edx, r13b or r14b as the value; then leave once the budget ran out or the write hit translated code:
+			// jz +4 to the exit; test al, al; jz +12 over it
+			assembler.Call(&NativeStore, operand, { 0x41, 0x0F, 0xB6, static_cast<TMemory>(semantics == &StoreRegister0Address::Execute ? 0xD5 : 0xD6) });
+			entries.push_back(entry);
+			count();
+			assembler.Emit({ 0x74, 0x04, 0x84, 0xC0, 0x74, 0x0C });
+			leave(next);
+			continue;
+		}
+		else if (semantics == &JmpImm8::Execute || semantics == &JmpAddress::Execute)
+		{
+			const auto target = (semantics == &JmpImm8::Execute ? static_cast<TRegister>(operand) : static_cast<TAddress>(operand)) & address_mask;
+			entries.push_back(entry);
+			count();
+			leave(target);
+			jumped = true;
+			break;
+		}
+		else if (semantics == &JmpNotZeroImm8::Execute || semantics == &JmpNotZeroAddress::Execute)
+		{
+			// test r15b, r15b; jnz +12 over the jump when the zero flag is set
+			const auto target = (semantics == &JmpNotZeroImm8::Execute ? static_cast<TRegister>(operand) : static_cast<TAddress>(operand)) & address_mask;
+			entries.push_back(entry);
+			count();
+			assembler.Emit({ 0x45, 0x84, 0xFF, 0x75, 0x0C });
+			leave(target);
+			leave(next);
+			jumped = true;
+			break;
+		}
+		else
+		{
+			// network I/O and anything the instruction would fail on are left to the translated tier
+			next = static_cast<TAddress>(instruction.address);
+			break;
+		}
+
+		entries.push_back(entry);
+		count_and_continue();
+	}
+	if (entries.empty())
+		return;
+	if (!jumped)
+		leave(next);
+
+#ifdef CHIPS_NATIVE_TIER
+	const auto& code = assembler.Code();
+	const auto mapping = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return;
+	ranges::copy(code, static_cast<TMemory*>(mapping));
+	if (mprotect(mapping, code.size(), PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(mapping, code.size());
+		return;
+	}
+
+	auto native = make_shared<NativeCode>();
+	native->code = static_cast<TMemory*>(mapping);
+	native->code_size = code.size();
+	native->entries = move(entries);
+	block.native = native;
+
+	lock_guard lock(cache_mutex);
+	if (cache.size() >= MaxCachedNativeCode)
+		cache.clear();
+	cache.emplace(move(key), move(native));
+#endif
+}
+
+size_t VM::ExecuteNativeCode(size_t budget)
+{
+	const auto position = current_block_position;
+	const auto& native = *current_block->native;
+
+	NativeState state{ this, budget, ip, { registers[0], registers[1] }, flags.zero };
+	reinterpret_cast<void(*)(NativeState*, const TMemory*)>(native.code)(&state, native.code + native.entries[position]);
+	const auto executed = budget - state.budget;
+
+	// a write to translated code may have dropped the block, which already moved the position past its end
+	if (current_block_position == position)
+		current_block_position += executed;
+
+	for (int index = 0; index < 2; ++index)
+		if (state.registers[index] != registers[index])
+			Register(index, state.registers[index]);
+	if (static_cast<bool>(state.zero) != flags.zero)
+		FlagZero(state.zero);
+	ip = state.ip;
+	return executed;
+}
\ No newline at end of file
@@ -6,36 +6,67 @@ export module vm_machines;
 
 import std;
 import vm;
+import vm_instruction_set;
 
 using namespace std;
 
-vector instruction_set_01 = {
-	MakeLoadRegister0AddressInstruction({ 0x00 }),
-	MakeLoadRegister1AddressInstruction({ 0x01 }),
-	MakeLoadRegister0Imm8Instruction({ 0x02 }),
-	MakeLoadRegister1Imm8Instruction({ 0x03 }),
-	MakeStoreRegister0AddressInstruction({ 0x04 }),
-	MakeStoreRegister1AddressInstruction({ 0x05 }),
-	MakeAddRegister0Imm8Instruction({ 0x06 }),
-	MakeAddRegister0AddressInstruction({ 0x07 }),
-	MakeSubRegister0Imm8Instruction({ 0x08 }),
-	MakeSubRegister0AddressInstruction({ 0x09 }),
-	MakeJmpImm8Instruction({ 0x0A }),
-	MakeJmpNotZeroImm8Instruction({ 0x0B }),
-	MakeOutImm8Instruction({ 0x0C }),
-	MakeInInstruction({ 0x0D }),
-	MakeTestZeroInstruction({ 0x0E }),
-	MakeTestGreaterThanImm8Instruction({ 0x0F }),
-	};
+using InstructionSet01 = CompiledInstructionSet<1,
+	CompiledInstruction<LoadRegister0Address, 0x00>,
+	CompiledInstruction<LoadRegister1Address, 0x01>,
+	CompiledInstruction<LoadRegister0Imm8, 0x02>,
+	CompiledInstruction<LoadRegister1Imm8, 0x03>,
+	CompiledInstruction<StoreRegister0Address, 0x04>,
+	CompiledInstruction<StoreRegister1Address, 0x05>,
+	CompiledInstruction<AddRegister0Imm8, 0x06>,
+	CompiledInstruction<AddRegister0Address, 0x07>,
+	CompiledInstruction<SubRegister0Imm8, 0x08>,
+	CompiledInstruction<SubRegister0Address, 0x09>,
+	CompiledInstruction<JmpImm8, 0x0A>,
+	CompiledInstruction<JmpNotZeroImm8, 0x0B>,
+	CompiledInstruction<OutImm8, 0x0C>,
+	CompiledInstruction<In, 0x0D>,
+	CompiledInstruction<TestZero, 0x0E>,
+	CompiledInstruction<TestGreaterThanImm8, 0x0F>,
+	CompiledInstruction<Xfer, 0x10>
+>;
+auto instruction_table_01 = make_shared<const VMInstructionTable>(InstructionSet01::Instructions());
+
+// the same instructions with 16-bit addresses, jumps taking an address instead of an 8-bit immediate
+using InstructionSet16 = CompiledInstructionSet<2,
+	CompiledInstruction<LoadRegister0Address, 0x00>,
+	CompiledInstruction<LoadRegister1Address, 0x01>,
+	CompiledInstruction<LoadRegister0Imm8, 0x02>,
+	CompiledInstruction<LoadRegister1Imm8, 0x03>,
+	CompiledInstruction<StoreRegister0Address, 0x04>,
+	CompiledInstruction<StoreRegister1Address, 0x05>,
+	CompiledInstruction<AddRegister0Imm8, 0x06>,
+	CompiledInstruction<AddRegister0Address, 0x07>,
+	CompiledInstruction<SubRegister0Imm8, 0x08>,
+	CompiledInstruction<SubRegister0Address, 0x09>,
+	CompiledInstruction<JmpAddress, 0x0A>,
+	CompiledInstruction<JmpNotZeroAddress, 0x0B>,
+	CompiledInstruction<OutImm8, 0x0C>,
+	CompiledInstruction<In, 0x0D>,
+	CompiledInstruction<TestZero, 0x0E>,
+	CompiledInstruction<TestGreaterThanImm8, 0x0F>,
+	CompiledInstruction<Xfer, 0x10>
+>;
+auto instruction_table_16 = make_shared<const VMInstructionTable>(InstructionSet16::Instructions());
 
 export auto MakeTest01Machine()
 {
-	return make_shared<VM>(2, 30, instruction_set_01);
+	return make_shared<VM>(2, 30, instruction_table_01, &InstructionSet01::dispatch);
 }
 
 export auto MakeTest02Machine()
 {
-	return make_shared<VM>(2, 128, instruction_set_01);
+	return make_shared<VM>(2, 128, instruction_table_01, &InstructionSet01::dispatch);
+}
+
+// a full 64KiB address space, only the pages written to are allocated
+export auto MakeTest16Machine()
+{
+	return make_shared<VM>(2, 0x10000, instruction_table_16, &InstructionSet16::dispatch);
 }
 
 export auto MakeRAM128Machine()
@@ -46,4 +77,25 @@ export auto MakeRAM128Machine()
 export auto MakeDisplay4x4Machine()
 {
 	return make_shared<Display>(4, 4);
+}
+
+// cells past the first 256 bytes of these are out of reach of OUTI8's 8-bit R1, a DMA next to them copies there with 16-bit addresses
+export auto MakeDisplay32x16Machine()
+{
+	return make_shared<Display>(32, 16);
+}
+
+export auto MakeDisplay80x25Machine()
+{
+	return make_shared<Display>(80, 25);
+}
+
+export auto MakeDMAMachine()
+{
+	return make_shared<DMA>();
+}
+
+export auto MakeRAM64KMachine()
+{
+	return make_shared<RAM>(0x10000);
 }
\ No newline at end of file